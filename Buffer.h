@@ -99,6 +99,13 @@ public:
 	virtual unsigned int erase_until(const_iterator ittr){
 		return erase_until(const_cast<iterator>(ittr));
 	}
+	
+	//Removes elements from the back of the buffer
+	virtual unsigned int erase_back(unsigned int length){
+		if(length > _end) length = _end;
+		_end -= length;
+		return length;
+	}
 
     virtual unsigned int read(T* buffer, unsigned int length){
         return erase(copy(buffer,length));
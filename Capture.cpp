@@ -0,0 +1,278 @@
+#include "TCP.h"
+
+namespace TCP{
+//----------------------------------TrafficCapture---------------------------------------//
+	TrafficCapture::~TrafficCapture(){
+		close();
+		DELLK(capture_lock);
+	}
+
+	TrafficCapture::TrafficCapture()
+		:_file(INVALID_HANDLE_VALUE), _mapping(NULL), _view(NULL),
+		_viewOffset(0), _viewUsed(0), _lastConnection(0){
+		INITLK(capture_lock);
+	}
+
+	bool TrafficCapture::mapView(){
+		unsigned __int64 size = _viewOffset + CAPTURE_VIEW_SIZE;
+		_viewUsed = 0;
+		//mapping past the end of the file grows it
+		_mapping = CreateFileMapping(_file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+		if(_mapping != NULL){
+			_view = (unsigned char*)MapViewOfFile(_mapping, FILE_MAP_WRITE, (DWORD)(_viewOffset >> 32), (DWORD)_viewOffset, CAPTURE_VIEW_SIZE);
+			if(_view == NULL){
+				CloseHandle(_mapping);
+				_mapping = NULL;
+			}
+		}
+		return _view != NULL;
+	}
+
+	void TrafficCapture::unmapView(){
+		if(_view != NULL){
+			UnmapViewOfFile(_view);
+			_view = NULL;
+		}
+		if(_mapping != NULL){
+			CloseHandle(_mapping);
+			_mapping = NULL;
+		}
+	}
+
+	void TrafficCapture::append(const void* buffer, unsigned int length){
+		const unsigned char* data = (const unsigned char*)buffer;
+		while(length > 0 && _view != NULL){
+			if(_viewUsed == CAPTURE_VIEW_SIZE){
+				unmapView();
+				_viewOffset += CAPTURE_VIEW_SIZE;
+				//the capture stops if the file can't grow
+				if(!mapView()){
+					break;
+				}
+			}
+			unsigned int count = std::min(length, CAPTURE_VIEW_SIZE - _viewUsed);
+			MEM_COPY(_view + _viewUsed, data, count);
+			_viewUsed += count;
+			data += count;
+			length -= count;
+		}
+	}
+
+	void TrafficCapture::writeRecord(CAPTURE_RECORD type, const unsigned int& connection, const unsigned char* buffer, const unsigned int& length){
+		CRTLK(capture_lock);
+		if(_view != NULL){
+			//the time is taken inside the lock, so records are in time order
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+
+			CaptureRecord record;
+			record.time = now.QuadPart - _start.QuadPart;
+			record.connection = connection;
+			record.length = length;
+			record.type = type;
+
+			append(&record, sizeof(record));
+			append(buffer, length);
+		}
+	}
+
+	bool TrafficCapture::open(const AnsiString& fileName){
+		close();
+
+		CRTLK(capture_lock);
+		_file = CreateFile(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(_file != INVALID_HANDLE_VALUE){
+			_viewOffset = 0;
+			_lastConnection = 0;
+			if(mapView()){
+				CaptureHeader header;
+				LARGE_INTEGER frequency;
+				QueryPerformanceFrequency(&frequency);
+				MEM_COPY(header.magic, CAPTURE_MAGIC, 8);
+				header.frequency = frequency.QuadPart;
+				QueryPerformanceCounter(&_start);
+				append(&header, sizeof(header));
+			}else{
+				CloseHandle(_file);
+				_file = INVALID_HANDLE_VALUE;
+			}
+		}
+		return isOpen();
+	}
+
+	void TrafficCapture::close(){
+		CRTLK(capture_lock);
+		if(_file != INVALID_HANDLE_VALUE){
+			unsigned __int64 used = size();
+			unmapView();
+
+			//cut the file down to what was written
+			LONG high = (LONG)(used >> 32);
+			SetFilePointer(_file, (LONG)used, &high, FILE_BEGIN);
+			SetEndOfFile(_file);
+
+			CloseHandle(_file);
+			_file = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	unsigned int TrafficCapture::openConnection(const AnsiString& address){
+		CRTLK(capture_lock);
+		unsigned int output = ++_lastConnection;
+		writeRecord(CAPTURE_OPEN, output, (const unsigned char*)address.c_str(), address.Length());
+		return output;
+	}
+
+	void TrafficCapture::write(const unsigned int& connection, const unsigned char* buffer, const unsigned int& length){
+		writeRecord(CAPTURE_DATA, connection, buffer, length);
+	}
+
+	void TrafficCapture::closeConnection(const unsigned int& connection){
+		writeRecord(CAPTURE_CLOSE, connection, NULL, 0);
+	}
+
+//----------------------------------TrafficReplay---------------------------------------//
+	TrafficReplay::~TrafficReplay(){
+		close();
+	}
+
+	TrafficReplay::TrafficReplay()
+		:_file(INVALID_HANDLE_VALUE), _mapping(NULL), _view(NULL),
+		_fileSize(0), _viewOffset(0), _viewSize(0), _viewRead(0),
+		_frequency(1), _stop(false),
+		OnOpen(NULL), OnClose(NULL), OnChunk(NULL), OnMessage(NULL){
+	}
+
+	bool TrafficReplay::mapView(){
+		if(_view != NULL){
+			UnmapViewOfFile((LPVOID)_view);
+			_view = NULL;
+		}
+		_viewRead = 0;
+		_viewSize = (_fileSize - _viewOffset < CAPTURE_VIEW_SIZE) ? (unsigned int)(_fileSize - _viewOffset) : CAPTURE_VIEW_SIZE;
+		if(_mapping != NULL && _viewSize > 0){
+			_view = (const unsigned char*)MapViewOfFile(_mapping, FILE_MAP_READ, (DWORD)(_viewOffset >> 32), (DWORD)_viewOffset, _viewSize);
+		}
+		return _view != NULL;
+	}
+
+	void TrafficReplay::unmapView(){
+		if(_view != NULL){
+			UnmapViewOfFile((LPVOID)_view);
+			_view = NULL;
+		}
+		if(_mapping != NULL){
+			CloseHandle(_mapping);
+			_mapping = NULL;
+		}
+	}
+
+	bool TrafficReplay::read(void* buffer, unsigned int length){
+		unsigned char* data = (unsigned char*)buffer;
+		while(length > 0){
+			if(_view == NULL){
+				return false;
+			}
+			if(_viewRead == _viewSize){
+				_viewOffset += _viewSize;
+				if(!mapView()){
+					return false;
+				}
+			}
+			unsigned int count = std::min(length, _viewSize - _viewRead);
+			MEM_COPY(data, _view + _viewRead, count);
+			_viewRead += count;
+			data += count;
+			length -= count;
+		}
+		return true;
+	}
+
+	bool TrafficReplay::open(const AnsiString& fileName){
+		close();
+
+		_file = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if(_file != INVALID_HANDLE_VALUE){
+			DWORD high = 0;
+			DWORD low = GetFileSize(_file, &high);
+			_fileSize = ((unsigned __int64)high << 32) | low;
+			_viewOffset = 0;
+			_mapping = CreateFileMapping(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+			CaptureHeader header;
+			if(mapView() && read(&header, sizeof(header)) && std::equal(header.magic, header.magic+8, CAPTURE_MAGIC)){
+				_frequency = header.frequency;
+			}else{
+				close();
+			}
+		}
+		return isOpen();
+	}
+
+	void TrafficReplay::close(){
+		unmapView();
+		if(_file != INVALID_HANDLE_VALUE){
+			CloseHandle(_file);
+			_file = INVALID_HANDLE_VALUE;
+		}
+		_streams.clear();
+	}
+
+	unsigned int TrafficReplay::run(const double& speed){
+		unsigned int output = 0;
+		CaptureRecord record;
+		std::vector<unsigned char> data, message;
+		LARGE_INTEGER start, now;
+
+		QueryPerformanceCounter(&start);
+		_stop = false;
+		while(!_stop && read(&record, sizeof(record)) && record.type != CAPTURE_END){
+			data.resize(record.length);
+			if(record.length > 0 && !read(data.begin(), record.length)){
+				break;
+			}
+
+			//wait for the record's time, scaled by the speed
+			if(speed > 0){
+				double due = (__int64)record.time / speed;
+				QueryPerformanceCounter(&now);
+				double elapsed = (double)(now.QuadPart - start.QuadPart);
+				if(due > elapsed){
+					Sleep((DWORD)((due - elapsed)*1000/(__int64)_frequency));
+				}
+			}
+
+			switch(record.type){
+				case CAPTURE_OPEN:
+					_streams[record.connection].clear();
+					if(OnOpen != NULL){
+						OnOpen(record.connection, AnsiString((const char*)data.begin(), data.size()));
+					}
+					break;
+				case CAPTURE_DATA:{
+					if(OnChunk != NULL){
+						OnChunk(record.connection, data.begin(), data.size());
+					}
+					StreamBuffer<unsigned char>& stream = _streams[record.connection];
+					stream.write(data.begin(), data.size());
+					message.clear();
+					while(GetMessageFromStreamBuffer(stream, message)){
+						if(OnMessage != NULL){
+							OnMessage(record.connection, message);
+						}
+						message.clear();
+					}
+				}break;
+				case CAPTURE_CLOSE:
+					if(OnClose != NULL){
+						OnClose(record.connection, AnsiString());
+					}
+					_streams.erase(record.connection);
+					break;
+			}
+			output++;
+		}
+		return output;
+	}
+
+}; //end namespace TCP
@@ -0,0 +1,139 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include "buffer.h"
+#include "CriticalLock.h"
+#include <System.hpp>
+#include <map>
+
+namespace TCP{
+	//record types in a capture file
+	//0 is never written, the unused end of the file is zero filled if the capture was not closed
+	enum CAPTURE_RECORD{
+		CAPTURE_END,
+		CAPTURE_OPEN,	//a connection was made, the data is the remote address
+		CAPTURE_DATA,	//a chunk of data was read from the connection
+		CAPTURE_CLOSE	//the connection was closed
+	};
+
+	#pragma pack(push, 1)
+	//start of a capture file
+	struct CaptureHeader{
+		char magic[8];
+		//QueryPerformanceFrequency when the capture was made, record times are in these units
+		unsigned __int64 frequency;
+	};
+
+	//each record is followed by "length" bytes of data
+	struct CaptureRecord{
+		//QueryPerformanceCounter ticks since the capture was opened
+		unsigned __int64 time;
+		unsigned int connection;
+		unsigned int length;
+		unsigned char type;
+	};
+	#pragma pack(pop)
+
+	const char CAPTURE_MAGIC[8] = {'T','C','P','C','A','P','1',0};
+
+	//bytes of the file mapped at a time, must be a multiple of the allocation granularity (64KB)
+	const unsigned int CAPTURE_VIEW_SIZE = 64*1024*1024;
+
+	//Append only capture of the data read from connections, written through a memory mapped view of the file.
+	//Writing a chunk costs a lock, a counter read and a copy into the mapped view, the OS writes the pages to disk.
+	//The capture must outlive any client or server using it.
+	class TrafficCapture{
+	protected:
+		HANDLE _file;
+		HANDLE _mapping;
+		unsigned char* _view;
+		//file offset of the view, and bytes written to it
+		unsigned __int64 _viewOffset;
+		unsigned int _viewUsed;
+
+		LARGE_INTEGER _start;
+		unsigned int _lastConnection;
+
+		CRITICAL_SECTION capture_lock;
+
+		//map the view at _viewOffset, growing the file to fit it
+		bool mapView();
+		void unmapView();
+		//copy data to the end of the capture, moving the view along when it is full
+		void append(const void* buffer, unsigned int length);
+		void writeRecord(CAPTURE_RECORD type, const unsigned int& connection, const unsigned char* buffer, const unsigned int& length);
+
+	public:
+		~TrafficCapture();
+		TrafficCapture();
+
+		//create the capture file, replacing any existing file
+		bool open(const AnsiString& fileName);
+		//unmap the file and cut off the unused end
+		void close();
+		bool isOpen() const{	return _view != NULL;	}
+
+		//bytes written to the capture
+		unsigned __int64 size() const{	return _viewOffset + _viewUsed;	}
+
+		//record a new connection, returns the id to record its data with
+		unsigned int openConnection(const AnsiString& address);
+		//record a chunk of data read from the connection
+		void write(const unsigned int& connection, const unsigned char* buffer, const unsigned int& length);
+		//record the connection closing
+		void closeConnection(const unsigned int& connection);
+	};
+
+	//Feeds a capture file back through StreamBuffer and GetMessageFromStreamBuffer.
+	//To replay against a server, send each message from OnMessage with a client per connection.
+	class TrafficReplay{
+	public:
+		typedef void (__closure* ConnectionEvent)(unsigned int connection, const AnsiString& address);
+		typedef void (__closure* ChunkEvent)(unsigned int connection, const unsigned char* buffer, unsigned int length);
+		typedef void (__closure* MessageEvent)(unsigned int connection, std::vector<unsigned char>& message);
+
+	protected:
+		HANDLE _file;
+		HANDLE _mapping;
+		const unsigned char* _view;
+		unsigned __int64 _fileSize;
+		unsigned __int64 _viewOffset;
+		unsigned int _viewSize;
+		unsigned int _viewRead;
+
+		unsigned __int64 _frequency;
+		bool _stop;
+
+		//the instream of each connection
+		std::map<unsigned int, StreamBuffer<unsigned char> > _streams;
+
+		bool mapView();
+		void unmapView();
+		//copy the next bytes of the file, returns false at the end of the file
+		bool read(void* buffer, unsigned int length);
+
+	public:
+		~TrafficReplay();
+		TrafficReplay();
+
+		bool open(const AnsiString& fileName);
+		void close();
+		bool isOpen() const{	return _mapping != NULL;	}
+
+		//replay every record
+		//speed 1 keeps the original timing, 2 replays twice as fast, 0 replays as fast as possible
+		//returns the number of records replayed
+		unsigned int run(const double& speed = 1);
+		//stop run, can be called from the events
+		void stop(){	_stop = true;	}
+
+		ConnectionEvent OnOpen;
+		ConnectionEvent OnClose;
+		//raw data, as it was read from the socket
+		ChunkEvent OnChunk;
+		//complete messages, as getMessage returns them, control messages such as heartbeats are skipped
+		MessageEvent OnMessage;
+	};
+}; //end namespace TCP
+
+#endif //_CAPTURE_H
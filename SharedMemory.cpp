@@ -0,0 +1,209 @@
+#include "SharedMemory.h"
+#include <string.h>
+
+#ifndef HWND_MESSAGE
+#define HWND_MESSAGE ((HWND)-3)
+#endif
+
+namespace TCP{
+	const UINT WM_SHM_READ = RegisterWindowMessage("TCPSharedMemoryRead");
+	const UINT WM_SHM_WRITE = RegisterWindowMessage("TCPSharedMemoryWrite");
+
+//----------------------------------ShmRing---------------------------------------//
+	void ShmRing::notify(const ShmEndpoint* endpoint, const UINT& message){
+		//the handle is written by the other process, and may belong to another window once the other side closed
+		HWND window = (HWND)endpoint->window;
+		char className[sizeof(SHM_WINDOW_CLASS)+1];
+		if(window != NULL && IsWindow(window) && GetClassName(window, className, sizeof(className)) > 0
+			&& strcmp(className, SHM_WINDOW_CLASS) == 0){
+			PostMessage(window, message, (WPARAM)endpoint->id, 0);
+		}
+	}
+	
+	unsigned int ShmRing::write(const unsigned char* buffer, const unsigned int& length){
+		unsigned int output = 0;
+		while(output < length){
+			unsigned int count = std::min(length - output, space());
+			if(count == 0){
+				//ask the reader to notify when it frees space, then check again in case it already did
+				exchange(_header->writerWaiting, 1);
+				if(space() == 0){
+					break;
+				}
+				continue;
+			}
+			unsigned int head = (unsigned int)_header->head;
+			unsigned int at = head & (_size-1);
+			unsigned int first = std::min(count, _size - at);
+			MEM_COPY(_data + at, buffer + output, first);
+			MEM_COPY(_data, buffer + output + first, count - first);
+			//publishing head is a full barrier, the reader never sees it before the data
+			exchange(_header->head, (LONG)(head + count));
+			output += count;
+		}
+		if(output > 0 && exchange(_header->readerWaiting, 0)){
+			notify(_reader, WM_SHM_READ);
+		}
+		return output;
+	}
+
+	unsigned int ShmRing::read(unsigned char* buffer, const unsigned int& length){
+		unsigned int count = std::min(length, available());
+		if(count > 0){
+			unsigned int tail = (unsigned int)_header->tail;
+			unsigned int at = tail & (_size-1);
+			unsigned int first = std::min(count, _size - at);
+			MEM_COPY(buffer, _data + at, first);
+			MEM_COPY(buffer + first, _data, count - first);
+			exchange(_header->tail, (LONG)(tail + count));
+			if(exchange(_header->writerWaiting, 0)){
+				notify(_writer, WM_SHM_WRITE);
+			}
+		}
+		return count;
+	}
+
+	bool ShmRing::armRead(){
+		exchange(_header->readerWaiting, 1);
+		return available() == 0;
+	}
+
+//----------------------------------SharedMemoryChannel---------------------------------------//
+	HWND SharedMemoryChannel::_window = NULL;
+	std::map<LONG, SharedMemoryChannel*> SharedMemoryChannel::_channels;
+	LONG SharedMemoryChannel::_lastId = 0;
+
+	SharedMemoryChannel::~SharedMemoryChannel(){
+		close();
+	}
+
+	SharedMemoryChannel::SharedMemoryChannel()
+		:_mapping(NULL), _header(NULL), _id(0),
+		OnRead(NULL), OnWrite(NULL), Data(NULL){
+	}
+
+	bool SharedMemoryChannel::create(const AnsiString& name, const unsigned int& ringSize){
+		return open(name, true, ringSize);
+	}
+
+	bool SharedMemoryChannel::open(const AnsiString& name){
+		return open(name, false, 0);
+	}
+
+	bool SharedMemoryChannel::open(const AnsiString& name, bool create, unsigned int ringSize){
+		close();
+		_name = name;
+
+		if(create){
+			_mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(ShmHeader) + 2*ringSize, name.c_str());
+			if(_mapping != NULL && GetLastError() == ERROR_ALREADY_EXISTS){
+				CloseHandle(_mapping);
+				_mapping = NULL;
+			}
+		}else{
+			_mapping = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+		}
+		if(_mapping != NULL){
+			_header = (ShmHeader*)MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+		}
+		if(_header == NULL){
+			close();
+			return false;
+		}
+
+		if(create){
+			//new pages are zero filled, so both rings start empty
+			MEM_COPY(_header->magic, SHM_MAGIC, 8);
+			_header->ringSize = ringSize;
+		}else{
+			//the other process decides the ring size, check it before trusting it
+			MEMORY_BASIC_INFORMATION region;
+			ringSize = _header->ringSize;
+			if(!std::equal(_header->magic, _header->magic+8, SHM_MAGIC) || ringSize == 0 || ringSize > (1u << 28) || (ringSize & (ringSize-1)) != 0
+				|| VirtualQuery(_header, &region, sizeof(region)) == 0 || region.RegionSize < sizeof(ShmHeader) + 2*ringSize){
+				close();
+				return false;
+			}
+			//claim the opening side, so no other connection naming the channel can write to its ring too
+			if(InterlockedCompareExchange((LONG*)&_header->opened, 1, 0) != 0){
+				close();
+				return false;
+			}
+		}
+
+		if(!addChannel()){
+			close();
+			return false;
+		}
+		int out = create ? 0 : 1;
+		int in = 1 - out;
+		//the endpoint is set before this side ever waits, so the other side never notifies it before it is set
+		_header->sides[out].id = _id;
+		InterlockedExchange((LONG*)&_header->sides[out].window, (LONG)_window);
+
+		unsigned char* data = (unsigned char*)(_header+1);
+		_out.attach(&_header->rings[out], data + out*ringSize, ringSize, &_header->sides[in], &_header->sides[out]);
+		_in.attach(&_header->rings[in], data + in*ringSize, ringSize, &_header->sides[out], &_header->sides[in]);
+		return true;
+	}
+
+	void SharedMemoryChannel::close(){
+		removeChannel();
+		if(_header != NULL){
+			UnmapViewOfFile(_header);
+			_header = NULL;
+		}
+		if(_mapping != NULL){
+			CloseHandle(_mapping);
+			_mapping = NULL;
+		}
+	}
+
+	bool SharedMemoryChannel::addChannel(){
+		if(_window == NULL){
+			WNDCLASS windowClass;
+			ZeroMemory(&windowClass, sizeof(windowClass));
+			windowClass.lpfnWndProc = windowProc;
+			windowClass.hInstance = HInstance;
+			windowClass.lpszClassName = SHM_WINDOW_CLASS;
+			//the class is left registered once the window is gone, registering it again fails harmlessly
+			RegisterClass(&windowClass);
+			//message-only, so it is never enumerated or broadcast to
+			_window = CreateWindow(SHM_WINDOW_CLASS, "", 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, HInstance, NULL);
+			if(_window == NULL){
+				return false;
+			}
+		}
+		//ids are never reused, so a notification posted to a closed channel is dropped
+		_id = ++_lastId;
+		_channels[_id] = this;
+		return true;
+	}
+
+	void SharedMemoryChannel::removeChannel(){
+		if(_id != 0){
+			_channels.erase(_id);
+			_id = 0;
+			if(_channels.empty() && _window != NULL){
+				DestroyWindow(_window);
+				_window = NULL;
+			}
+		}
+	}
+
+	LRESULT CALLBACK SharedMemoryChannel::windowProc(HWND window, UINT message, WPARAM wParam, LPARAM lParam){
+		if(message == WM_SHM_READ || message == WM_SHM_WRITE){
+			std::map<LONG, SharedMemoryChannel*>::iterator fnd = _channels.find((LONG)wParam);
+			if(fnd != _channels.end()){
+				SharedMemoryChannel* channel = fnd->second;
+				Event event = (message == WM_SHM_READ) ? channel->OnRead : channel->OnWrite;
+				if(event != NULL){
+					event(channel);
+				}
+			}
+			return 0;
+		}
+		return DefWindowProc(window, message, wParam, lParam);
+	}
+
+}; //end namespace TCP
@@ -0,0 +1,153 @@
+#ifndef _SHARED_MEMORY_H
+#define _SHARED_MEMORY_H
+
+#include "buffer.h"
+#include <Classes.hpp>
+#include <map>
+
+namespace TCP{
+	//bytes in each direction of a shared memory connection, must be a power of 2
+	const unsigned int SHM_RING_SIZE = 1 << 20;
+
+	//messages posted by one side of a channel to the other side's notification window, the WPARAM is the channel id
+	//they are registered, so a window of any other class that is posted one by mistake doesn't take it for one of its own
+	extern const UINT WM_SHM_READ;
+	extern const UINT WM_SHM_WRITE;
+	//class of the notification windows, the window handle comes from the other process and is checked against it
+	const char SHM_WINDOW_CLASS[] = "TCPSharedMemoryWindow";
+
+	//control data of one direction of a channel
+	//head and tail are on their own cache lines, the writer only changes head and the reader only changes tail
+	struct ShmRingHeader{
+		//bytes ever written
+		volatile LONG head;
+		char _pad0[60];
+		//bytes ever read
+		volatile LONG tail;
+		char _pad1[60];
+		//set by a side before it waits, cleared by the other side when it notifies
+		volatile LONG readerWaiting;
+		volatile LONG writerWaiting;
+		char _pad2[56];
+	};
+
+	//where to post notifications for one side of a channel
+	struct ShmEndpoint{
+		//the notification window of the side's process, and the channel's id in that process
+		volatile LONG window;
+		volatile LONG id;
+	};
+
+	//start of the shared memory, followed by the data of ring 0 and ring 1
+	//ring 0 is written by the side that created the channel, ring 1 by the side that opened it
+	struct ShmHeader{
+		char magic[8];
+		unsigned int ringSize;
+		//set by the side that opened the channel, a channel can only be opened once
+		volatile LONG opened;
+		//side 0 created the channel, side 1 opened it
+		ShmEndpoint sides[2];
+		char _pad[32];
+		ShmRingHeader rings[2];
+	};
+
+	const char SHM_MAGIC[8] = {'T','C','P','S','H','M','2',0};
+
+	//Single producer, single consumer byte ring in shared memory.
+	//The other side is only notified when it said it is waiting, so a busy connection makes no system calls.
+	class ShmRing{
+	protected:
+		ShmRingHeader* _header;
+		unsigned char* _data;
+		unsigned int _size;
+		//notified when there is data, and when there is space
+		const ShmEndpoint* _reader;
+		const ShmEndpoint* _writer;
+
+		static LONG exchange(volatile LONG& target, LONG value){
+			return InterlockedExchange((LONG*)&target, value);
+		}
+		//post to the endpoint's window, if it is still a notification window
+		static void notify(const ShmEndpoint* endpoint, const UINT& message);
+
+	public:
+		ShmRing():_header(NULL),_data(NULL),_size(0),_reader(NULL),_writer(NULL){}
+
+		void attach(ShmRingHeader* header, unsigned char* data, const unsigned int& size, const ShmEndpoint* reader, const ShmEndpoint* writer){
+			_header = header;
+			_data = data;
+			_size = size;
+			_reader = reader;
+			_writer = writer;
+		}
+
+		unsigned int available() const{	return (unsigned int)_header->head - (unsigned int)_header->tail;	}
+		unsigned int space() const{	return _size - available();	}
+
+		//write as much as fits, returns the bytes written
+		//if not everything fit, the writer is notified once the reader frees some
+		unsigned int write(const unsigned char* buffer, const unsigned int& length);
+		//read up to length bytes, returns the bytes read
+		unsigned int read(unsigned char* buffer, const unsigned int& length);
+		//ask the writer to notify the reader, returns false if data arrived in the meantime
+		bool armRead();
+	};
+
+	//Both directions of a connection between two processes on the same host.
+	//Each process has one message-only window for all its channels, and each side posts WM_SHM_READ and WM_SHM_WRITE
+	//straight to the other side's window, so a wakeup is a single PostMessage and no threads are used.
+	//OnRead and OnWrite run on the thread that opened the channel, like the socket events.
+	//Channels must be opened and closed on the VCL thread.
+	class SharedMemoryChannel{
+	public:
+		typedef void (__closure* Event)(SharedMemoryChannel* channel);
+
+	protected:
+		AnsiString _name;
+		HANDLE _mapping;
+		ShmHeader* _header;
+		ShmRing _in;
+		ShmRing _out;
+		//id in this process' notification window, 0 while closed
+		LONG _id;
+
+		//the notification window, and the open channels by id
+		static HWND _window;
+		static std::map<LONG, SharedMemoryChannel*> _channels;
+		static LONG _lastId;
+		static LRESULT CALLBACK windowProc(HWND window, UINT message, WPARAM wParam, LPARAM lParam);
+
+		bool open(const AnsiString& name, bool create, unsigned int ringSize);
+		//add the channel to the notification window, creating the window for the first channel
+		bool addChannel();
+		//remove the channel, destroying the window with the last channel
+		void removeChannel();
+
+	public:
+		~SharedMemoryChannel();
+		SharedMemoryChannel();
+
+		//create a new channel, fails if the name is already in use
+		bool create(const AnsiString& name, const unsigned int& ringSize = SHM_RING_SIZE);
+		//open a channel created by another process
+		bool open(const AnsiString& name);
+		void close();
+		bool isOpen() const{	return _header != NULL;	}
+		const AnsiString& Name() const{	return _name;	}
+
+		unsigned int write(const unsigned char* buffer, const unsigned int& length){	return _out.write(buffer, length);	}
+		unsigned int read(unsigned char* buffer, const unsigned int& length){	return _in.read(buffer, length);	}
+		unsigned int available() const{	return _in.available();	}
+		//call once everything available was read, returns false if more arrived and should be read first
+		bool armRead(){	return _in.armRead();	}
+
+		//data arrived after armRead
+		Event OnRead;
+		//space was freed after a write did not fit
+		Event OnWrite;
+		//user data, usually the owner of the channel
+		void* Data;
+	};
+}; //end namespace TCP
+
+#endif //_SHARED_MEMORY_H
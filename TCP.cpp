@@ -8,7 +8,7 @@ namespace TCP{
 		StreamBuffer<stream_type>::iterator fnd = stream.find(HEAD_START);
 		while(fnd != stream.end()){
 			StreamBuffer<stream_type>::iterator fnd_start = fnd+5;
-			if(*fnd_start == TEXT_START){ //length found
+			if(*fnd_start == TEXT_START || *fnd_start == CONTROL_START){ //length found
 				unsigned int messageLength = *((unsigned int*)(fnd+1));
 				if(stream.length() < messageLength+7+(fnd-stream.begin())){
 					//the stream is not long enough to contain the data
@@ -16,6 +16,12 @@ namespace TCP{
 				}else{
 					StreamBuffer<stream_type>::iterator fnd_end = fnd_start+messageLength+1;
 					if(*fnd_end == END_TEXT && *(fnd_end+1) == END_TRANS){//found a complete message
+						if(*fnd_start == CONTROL_START){
+							//not for the application, skip it
+							stream.erase_until(fnd_end+2);
+							fnd = stream.find(HEAD_START);
+							continue;
+						}
 						message.insert(message.begin(), fnd_start+1, fnd_end);
 						output = true;
 						stream.erase_until(fnd_end+2);
@@ -34,37 +40,134 @@ namespace TCP{
 	}
 	
 	template<typename stream_type>
-	void WriteMessageToStreamBuffer(StreamBuffer<stream_type>& stream, const unsigned char * buffer, const unsigned int& length){
+	void WriteMessageToStreamBuffer(StreamBuffer<stream_type>& stream, const unsigned char * buffer, const unsigned int& length, const char& start){
 		stream.write(HEAD_START);
 		stream.write((const unsigned char*)&length,4);
-		stream.write(TEXT_START);
+		stream.write(start);
 		stream.write(buffer,length);
 		stream.write(END_TEXT);
 		stream.write(END_TRANS);
 	}
+	
+	//also used outside this file, by client_base::getMessage and TrafficReplay
+	template bool GetMessageFromStreamBuffer<unsigned char>(StreamBuffer<unsigned char>& stream, std::vector<unsigned char>& message);
 //----------------------------------client_base---------------------------------------//
+	void client_base::fillOutstream(){
+		int lane = 0;
+		while(outstream.length() < OUTSTREAM_BATCH && lane < PRIORITY_COUNT){
+			if(lanes[lane].empty()){
+				lane++;
+			}else{
+				//take whole messages, SOH <4-byte-data-length> STX <data> ETX EOT, until the batch is full
+				//the first one is always taken, so a message larger than the batch goes as one
+				unsigned int length = 0;
+				while(length < lanes[lane].length() && outstream.length()+length < OUTSTREAM_BATCH){
+					length += *((unsigned int*)(lanes[lane].begin()+length+1)) + 8;
+				}
+				outstream.write(lanes[lane].begin(), length);
+				lanes[lane].erase(length);
+				outSegments.push_back(std::make_pair(lane, length));
+			}
+		}
+	}
+	
+	void client_base::countSent(unsigned int length){
+		while(length > 0 && !outSegments.empty()){
+			std::pair<int, unsigned int>& segment = outSegments.front();
+			unsigned int counted = std::min(length, segment.second);
+			laneSent[segment.first] += counted;
+			segment.second -= counted;
+			length -= counted;
+			if(segment.second == 0){
+				outSegments.pop_front();
+			}
+		}
+	}
+	
+	void client_base::clearOutgoing(){
+		CRTLK(out_stream_lock);
+		outstream.clear();
+		outSegments.clear();
+		for(int i = 0; i < PRIORITY_COUNT; i++){
+			lanes[i].clear();
+			laneSent[i] = laneQueued[i];
+		}
+	}
+	
 	template<typename socket_type>
 	bool client_base::sendOut(socket_type* socket){
 		int sent = -1;
-		if(!outstream.empty()){
-			try{
-				sent = socket->SendBuf(outstream.begin(),outstream.length());
-			}catch(...){
-				sent = -1;
+		fillOutstream();
+		while(!outstream.empty()){
+			unsigned int length = outstream.length();
+			if(sendingShared() && tcpRemaining == 0){
+				sent = shm->write(outstream.begin(), length);
+			}else{
+				//after switching, only the data queued before the switch goes to the socket
+				if(tcpRemaining > 0 && tcpRemaining < length){
+					length = tcpRemaining;
+				}
+				try{
+					sent = socket->SendBuf(outstream.begin(),length);
+				}catch(...){
+					sent = -1;
+				}
+				if(sent > 0 && tcpRemaining > 0){
+					tcpRemaining -= sent;
+				}
 			}
 			if(sent > 0){
+				//the socket or ring is full, OnWrite will send the rest
+				bool partial = (unsigned int)sent < length;
 				outstream.erase(sent);
+				countSent(sent);
+				if(partial){
+					break;
+				}
+				fillOutstream();
+			}else{
+				break;
 			}
 		}
 		return sent > 0;
 	}
 	
+	bool client_base::queue(const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority){
+		CRTLK(out_stream_lock);
+		WriteMessageToStreamBuffer(lanes[priority], buffer, length);
+		laneQueued[priority] += length+8;
+		sentSinceHeartbeat = true;
+		return outstream.empty();
+	}
+	
+	bool client_base::queueFramed(const StreamBuffer<unsigned char>& frame, MESSAGE_PRIORITY priority){
+		CRTLK(out_stream_lock);
+		lanes[priority].write(frame);
+		laneQueued[priority] += frame.length();
+		sentSinceHeartbeat = true;
+		return outstream.empty();
+	}
+	
+	template<typename socket_type>
+	bool client_base::send(socket_type* socket, const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority){
+		CRTLK(out_stream_lock);
+		return queue(buffer, length, priority)?sendOut(socket):true;
+	}
+	
 	template<typename socket_type>
-	bool client_base::send(socket_type* socket, const unsigned char * buffer, const unsigned int& length){
+	bool client_base::sendFramed(socket_type* socket, const StreamBuffer<unsigned char>& frame, MESSAGE_PRIORITY priority){
 		CRTLK(out_stream_lock);
-		bool tosend = outstream.empty();
-		WriteMessageToStreamBuffer(outstream, buffer, length);
-		return tosend?sendOut(socket):true;
+		return queueFramed(frame, priority)?sendOut(socket):true;
+	}
+	
+	template<typename socket_type>
+	bool client_base::sendControl(socket_type* socket, CONTROL_TYPE type, const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority){
+		std::vector<unsigned char> message(length+1);
+		message[0] = (unsigned char)type;
+		MEM_COPY(message.begin()+1, buffer, length);
+		StreamBuffer<unsigned char> frame(message.size()+8);
+		WriteMessageToStreamBuffer(frame, message.begin(), message.size(), CONTROL_START);
+		return sendFramed(socket, frame, priority);
 	}
 	
 	template<typename socket_type>
@@ -75,6 +178,278 @@ namespace TCP{
 			tmpInBuff.reserve(tmpInSz);
 			tmpInSz = socket->ReceiveBuf(tmpInBuff.begin(), tmpInSz);
 			instream.write(tmpInBuff.begin(), tmpInSz);
+			lastRead = GetTickCount();
+			if(capture != NULL && tmpInSz > 0){
+				capture->write(captureId, tmpInBuff.begin(), tmpInSz);
+			}
+		}
+	}
+	
+	void client_base::startCapture(TrafficCapture* trafficCapture, const AnsiString& address){
+		stopCapture();
+		if(trafficCapture != NULL && trafficCapture->isOpen()){
+			CRTLK(in_stream_lock);
+			capture = trafficCapture;
+			captureId = capture->openConnection(address);
+		}
+	}
+	
+	void client_base::stopCapture(){
+		CRTLK(in_stream_lock);
+		if(capture != NULL){
+			capture->closeConnection(captureId);
+			capture = NULL;
+		}
+	}
+	
+	template<typename socket_type>
+	void client_base::switchToShared(socket_type* socket, CONTROL_TYPE marker){
+		CRTLK(out_stream_lock);
+		unsigned char type = (unsigned char)marker;
+		WriteMessageToStreamBuffer(lanes[PRIORITY_BULK], &type, 1, CONTROL_START);
+		laneQueued[PRIORITY_BULK] += 1+8;
+		//everything queued so far, and the marker last, goes to the socket
+		for(int lane = 0; lane < PRIORITY_COUNT; lane++){
+			if(!lanes[lane].empty()){
+				outstream.write(lanes[lane].begin(), lanes[lane].length());
+				outSegments.push_back(std::make_pair(lane, lanes[lane].length()));
+				lanes[lane].clear();
+			}
+		}
+		tcpRemaining = outstream.length();
+		sendOut(socket);
+	}
+	
+	int client_base::takeOffer(AnsiString& name){
+		CRTLK(in_stream_lock);
+		if(instream.length() < 7){
+			return 0;
+		}
+		StreamBuffer<unsigned char>::iterator head = instream.begin();
+		unsigned int length = *((unsigned int*)(head+1));
+		if(*head != HEAD_START || *(head+5) != CONTROL_START || length < 1 || *(head+6) != CONTROL_SHM_OFFER){
+			return -1;
+		}
+		if(instream.length() < length+8){
+			return 0;
+		}
+		name = AnsiString((const char*)(head+7), length-1);
+		instream.erase(length+8);
+		return 1;
+	}
+	
+	int client_base::takeAnswer(){
+		CRTLK(in_stream_lock);
+		StreamBuffer<unsigned char>::iterator head = instream.begin();
+		StreamBuffer<unsigned char>::iterator end = instream.begin()+instream.length();
+		//getMessage removes whole messages from the front, so the instream starts at a message
+		while(end-head >= 8 && *head == HEAD_START){
+			unsigned int length = *((unsigned int*)(head+1));
+			if((unsigned int)(end-head) < length+8){
+				break;
+			}
+			StreamBuffer<unsigned char>::iterator next = head+length+8;
+			if(*(head+5) == CONTROL_START && length == 1
+				&& (*(head+6) == CONTROL_SHM_ACCEPT || *(head+6) == CONTROL_SHM_REJECT || *(head+6) == CONTROL_SHM_SWITCH)){
+				int output = *(head+6);
+				//close the gap over the message
+				MEM_COPY(head, next, end-next);
+				instream.erase_back(length+8);
+				return output;
+			}
+			head = next;
+		}
+		return -1;
+	}
+	
+	void client_base::takeControls(std::vector<std::vector<unsigned char> >& controls){
+		CRTLK(in_stream_lock);
+		StreamBuffer<unsigned char>::iterator head = instream.begin();
+		StreamBuffer<unsigned char>::iterator end = instream.begin()+instream.length();
+		//the messages that are kept are moved down over the ones taken
+		StreamBuffer<unsigned char>::iterator kept = head;
+		while(end-head >= 8 && *head == HEAD_START){
+			unsigned int length = *((unsigned int*)(head+1));
+			if((unsigned int)(end-head) < length+8){
+				break;
+			}
+			StreamBuffer<unsigned char>::iterator next = head+length+8;
+			unsigned char type = *(head+6);
+			if(*(head+5) == CONTROL_START && length >= 1 && (type <= CONTROL_UNSUBSCRIBE_PREFIX || type == CONTROL_HEARTBEAT)){
+				controls.push_back(std::vector<unsigned char>(head+6, head+6+length));
+			}else{
+				if(kept != head){
+					MEM_COPY(kept, head, length+8);
+				}
+				kept += length+8;
+			}
+			head = next;
+		}
+		if(kept != head){
+			MEM_COPY(kept, head, end-head);
+			instream.erase_back(head-kept);
+		}
+	}
+	
+	template<typename socket_type>
+	void client_base::offerShared(socket_type* socket, SharedMemoryChannel::Event onRead, SharedMemoryChannel::Event onWrite, void* data){
+		static LONG channels = 0;
+		closeShared();
+		shm = new SharedMemoryChannel();
+		AnsiString name = "TCPShm_" + IntToStr((int)GetCurrentProcessId()) + "_" + IntToStr((int)InterlockedIncrement(&channels));
+		if(shm->create(name)){
+			shm->OnRead = onRead;
+			shm->OnWrite = onWrite;
+			shm->Data = data;
+			shmState = SHM_OFFERED;
+			
+			shmOffered = GetTickCount();
+			sendControl(socket, CONTROL_SHM_OFFER, (const unsigned char*)name.c_str(), name.Length(), PRIORITY_HIGH);
+		}else{
+			closeShared();
+		}
+	}
+	
+	template<typename socket_type>
+	void client_base::updateShared(socket_type* socket, bool acceptOffers, SharedMemoryChannel::Event onRead, SharedMemoryChannel::Event onWrite, void* data){
+		switch(shmState){
+			case SHM_UNKNOWN:{
+				AnsiString name;
+				int offer = takeOffer(name);
+				if(offer < 0){
+					shmState = SHM_OFF;
+				}else if(offer > 0){
+					shm = new SharedMemoryChannel();
+					if(acceptOffers && shm->open(name)){
+						shm->OnRead = onRead;
+						shm->OnWrite = onWrite;
+						shm->Data = data;
+						shmState = SHM_SWITCHING;
+						switchToShared(socket, CONTROL_SHM_ACCEPT);
+					}else{
+						closeShared();
+						sendControl(socket, CONTROL_SHM_REJECT, NULL, 0, PRIORITY_HIGH);
+					}
+				}
+			}break;
+			case SHM_OFFERED:
+				switch(takeAnswer()){
+					case CONTROL_SHM_ACCEPT:
+						//the accept is the last thing the other side sends to the socket
+						shmState = SHM_ON;
+						switchToShared(socket, CONTROL_SHM_SWITCH);
+						readShared();
+						break;
+					case CONTROL_SHM_REJECT:
+						closeShared();
+						break;
+					default:
+						//the other side does not know about shared memory, stop looking for its answer
+						if(GetTickCount() - shmOffered >= SHM_ANSWER_TIMEOUT){
+							closeShared();
+						}
+				}
+				break;
+			case SHM_SWITCHING:
+				if(takeAnswer() == CONTROL_SHM_SWITCH){
+					shmState = SHM_ON;
+					readShared();
+				}
+				break;
+		}
+	}
+	
+	void client_base::readShared(){
+		CRTLK(in_stream_lock);
+		if(shm != NULL && shmState == SHM_ON){
+			//data written after the last check raises OnRead, so keep reading until the ring was seen empty
+			do{
+				tmpInSz = shm->available();
+				if(tmpInSz > 0){
+					tmpInBuff.reserve(tmpInSz);
+					tmpInSz = shm->read(tmpInBuff.begin(), tmpInSz);
+					instream.write(tmpInBuff.begin(), tmpInSz);
+					lastRead = GetTickCount();
+					if(capture != NULL){
+						capture->write(captureId, tmpInBuff.begin(), tmpInSz);
+					}
+				}
+			}while(!shm->armRead());
+		}
+	}
+	
+	void client_base::closeShared(){
+		CRTLK(out_stream_lock);
+		delete shm;
+		shm = NULL;
+		shmState = SHM_OFF;
+		tcpRemaining = 0;
+	}
+	
+	void client_base::startTimers(TimerWheel& wheel, const unsigned int& idleTimeout, const unsigned int& heartbeatInterval, TimerNode::Event onIdle, TimerNode::Event onHeartbeat, void* data){
+		lastRead = GetTickCount();
+		sentSinceHeartbeat = false;
+		
+		idleTimer.OnExpire = onIdle;
+		idleTimer.Data = data;
+		heartbeatTimer.OnExpire = onHeartbeat;
+		heartbeatTimer.Data = data;
+		
+		if(idleTimeout > 0){
+			wheel.arm(&idleTimer, idleTimeout);
+		}
+		if(heartbeatInterval > 0){
+			wheel.arm(&heartbeatTimer, heartbeatInterval);
+		}
+	}
+	
+	bool client_base::checkIdle(TimerWheel& wheel, const unsigned int& idleTimeout){
+		unsigned long idle = GetTickCount() - lastRead;
+		if(idle >= idleTimeout){
+			return true;
+		}
+		wheel.arm(&idleTimer, idleTimeout - idle);
+		return false;
+	}
+	
+	template<typename socket_type>
+	void client_base::heartbeat(socket_type* socket, TimerWheel& wheel, const unsigned int& heartbeatInterval){
+		if(!sentSinceHeartbeat){
+			sendControl(socket, CONTROL_HEARTBEAT, NULL, 0, PRIORITY_HIGH);
+		}
+		sentSinceHeartbeat = false;
+		wheel.arm(&heartbeatTimer, heartbeatInterval);
+	}
+	
+	void client_base::addDeadline(TimerWheel& wheel, MESSAGE_PRIORITY priority, const unsigned int& milliseconds, TimerNode::Event onExpire, void* data){
+		CRTLK(out_stream_lock);
+		if(laneSent[priority] < laneQueued[priority]){
+			SendDeadline* deadline = new SendDeadline();
+			deadline->lane = priority;
+			deadline->end = laneQueued[priority];
+			deadline->OnExpire = onExpire;
+			deadline->Data = data;
+			deadline->position = deadlines.insert(deadlines.end(), deadline);
+			wheel.arm(deadline, milliseconds);
+		}
+	}
+	
+	bool client_base::expireDeadline(SendDeadline* deadline){
+		CRTLK(out_stream_lock);
+		bool output = laneSent[deadline->lane] < deadline->end;
+		deadlines.erase(deadline->position);
+		delete deadline;
+		return output;
+	}
+	
+	void client_base::cancelTimers(){
+		CRTLK(out_stream_lock);
+		idleTimer.cancel();
+		heartbeatTimer.cancel();
+		//deleting a deadline disarms it
+		while(!deadlines.empty()){
+			delete deadlines.front();
+			deadlines.pop_front();
 		}
 	}
 
@@ -85,19 +460,26 @@ namespace TCP{
 				delete _socket;
 			}__except(EXCEPTION_EXECUTE_HANDLER){}
 		}
+		//the timers are in client_base, which outlives the wheel
+		cancelTimers();
+		delete _timer;
 	}
 	
 	client::client()
 		:_prt(-1), _socket(NULL),OnConnect(NULL), 
 		OnDisconnect(NULL), OnRead(NULL), OnFailedConnect(NULL),
-		_constat(CONNECTION_NOT_STARTED){	
+		_constat(CONNECTION_NOT_STARTED), _wheel(TIMER_RESOLUTION),
+		_timer(NULL), _idleTimeout(0), _heartbeatInterval(0), _capture(NULL),
+		_sharedMemory(false), OnIdleTimeout(NULL), OnSendTimeout(NULL){	
 		
 	}
 	
 	client::client(const AnsiString& address, const int& port)
 		:_addr(address), _prt(port), _socket(NULL), 
 		OnConnect(NULL), OnDisconnect(NULL), OnRead(NULL),
-		_constat(CONNECTION_NOT_STARTED){
+		_constat(CONNECTION_NOT_STARTED), _wheel(TIMER_RESOLUTION),
+		_timer(NULL), _idleTimeout(0), _heartbeatInterval(0), _capture(NULL),
+		_sharedMemory(false), OnIdleTimeout(NULL), OnSendTimeout(NULL){
 		
 	}
 	
@@ -118,7 +500,8 @@ namespace TCP{
 		_socket->OnRead = _onread;
 		_socket->OnError = _onerror;
 		
-		outstream.clear();
+		closeShared();
+		clearOutgoing();
 		instream.clear();
 	}
 	
@@ -166,6 +549,15 @@ namespace TCP{
 
 	void __fastcall client::_onconnect(TObject* Sender, TCustomWinSocket *Socket){
 		_constat = CONNECTION_CONNECTED;
+		if(_idleTimeout > 0 || _heartbeatInterval > 0){
+			startTimer();
+			startTimers(_wheel, _idleTimeout, _heartbeatInterval, _onidletimer, _onheartbeattimer, this);
+		}
+		startCapture(_capture, Socket->RemoteAddress);
+		shmState = SHM_OFF;
+		if(_sharedMemory && IsLocalConnection(Socket)){
+			offerShared(Socket, _onsharedread, _onsharedwrite, this);
+		}
 		if(OnConnect != NULL){
 			OnConnect(this);
 		}
@@ -174,6 +566,9 @@ namespace TCP{
 
 	void __fastcall client::_ondisconnect(TObject* Sender, TCustomWinSocket *Socket){
 		_constat = CONNECTION_DISCONNECTED;
+		cancelTimers();
+		stopCapture();
+		closeShared();
 		if(OnDisconnect != NULL){
 			OnDisconnect(this);
 		}
@@ -181,11 +576,26 @@ namespace TCP{
 	
 	void __fastcall client::_onread(TObject* Sender, TCustomWinSocket* Socket){
 		readSocket(Socket);
+		updateShared(Socket, false, _onsharedread, _onsharedwrite, this);
+		if(OnRead!= NULL){
+			OnRead(this);
+		}
+	}
+	
+	void client::_onsharedread(SharedMemoryChannel* channel){
+		readShared();
 		if(OnRead!= NULL){
 			OnRead(this);
 		}
 	}
 	
+	void client::_onsharedwrite(SharedMemoryChannel* channel){
+		if(_constat == CONNECTION_CONNECTED){
+			CRTLK(out_stream_lock);
+			sendOut(_socket->Socket);
+		}
+	}
+	
 
 	void __fastcall client::_onwrite(TObject* Sender, TCustomWinSocket* Socket){
 		CRTLK(out_stream_lock);
@@ -212,29 +622,135 @@ namespace TCP{
 		ErrorCode = 0;
 	}
 	
-	bool client::send(const unsigned char * buffer, const unsigned int& length){
-		return (_constat == CONNECTION_CONNECTED) ? client_base::send(_socket->Socket,buffer,length) : false;
+	bool client::send(const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority, const unsigned int& deadline){
+		if(_constat != CONNECTION_CONNECTED){
+			return false;
+		}
+		bool output = client_base::send(_socket->Socket,buffer,length,priority);
+		//the message is queued even when the socket filled up before it was sent, which is what the deadline is for
+		if(deadline > 0){
+			startTimer();
+			addDeadline(_wheel, priority, deadline, _onsenddeadline, this);
+		}
+		return output;
+	}
+	
+	void client::startTimer(){
+		if(_timer == NULL){
+			_wheel.start(GetTickCount());
+			_timer = new TTimer(NULL);
+			_timer->Interval = _wheel.resolution();
+			_timer->OnTimer = _ontimer;
+		}
+	}
+	
+	void __fastcall client::_ontimer(TObject* Sender){
+		_wheel.advance(GetTickCount());
+	}
+	
+	void client::_onidletimer(TimerNode* timer){
+		if(checkIdle(_wheel, _idleTimeout)){
+			if(OnIdleTimeout == NULL){
+				disconnect();
+			}else{
+				//re-arm first, disconnecting from the event cancels it again
+				_wheel.arm(&idleTimer, _idleTimeout);
+				OnIdleTimeout(this);
+			}
+		}
+	}
+	
+	void client::_onheartbeattimer(TimerNode* timer){
+		if(_constat == CONNECTION_CONNECTED){
+			heartbeat(_socket->Socket, _wheel, _heartbeatInterval);
+		}
+	}
+	
+	void client::_onsenddeadline(TimerNode* timer){
+		if(expireDeadline(static_cast<SendDeadline*>(timer))){
+			if(OnSendTimeout == NULL){
+				disconnect();
+			}else{
+				OnSendTimeout(this);
+			}
+		}
+	}
+	
+	bool client::sendSubscription(CONTROL_TYPE type, const AnsiString& topic){
+		return (_constat == CONNECTION_CONNECTED) ? sendControl(_socket->Socket, type, (const unsigned char*)topic.c_str(), topic.Length()) : false;
+	}
+	
+	bool client::subscribe(const AnsiString& topic, bool prefix){
+		return sendSubscription(prefix?CONTROL_SUBSCRIBE_PREFIX:CONTROL_SUBSCRIBE, topic);
+	}
+	
+	bool client::unsubscribe(const AnsiString& topic, bool prefix){
+		return sendSubscription(prefix?CONTROL_UNSUBSCRIBE_PREFIX:CONTROL_UNSUBSCRIBE, topic);
 	}
 	
 //----------------------------------server---------------------------------------//
 
-	bool serverClientSocket::send(const unsigned char * buffer, const unsigned int& length){
-		return _data.send<serverClientSocket>(this, buffer, length);
+	bool serverClientSocket::send(const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority, const unsigned int& deadline){
+		if(_server != NULL && _server->isWorker()){
+			//a failed SendBuf disconnects the client, which must not happen on its own worker
+			if(_data.queue(buffer, length, priority)){
+				_server->postSend(this);
+			}
+			return true;
+		}
+		bool output = _data.send<serverClientSocket>(this, buffer, length, priority);
+		//the message is queued even when the socket filled up before it was sent, which is what the deadline is for
+		if(deadline > 0 && _server != NULL){
+			_server->armSendDeadline(this, priority, deadline);
+		}
+		return output;
 	}
-
+	
+	bool serverClientSocket::sendFramed(const StreamBuffer<unsigned char>& frame, MESSAGE_PRIORITY priority){
+		if(_server != NULL && _server->isWorker()){
+			if(_data.queueFramed(frame, priority)){
+				_server->postSend(this);
+			}
+			return true;
+		}
+		return _data.sendFramed<serverClientSocket>(this, frame, priority);
+	}
+	
 	server::~server(){
 		stop();
+		delete _timer;
+		if(_window != NULL){
+			DeallocateHWnd(_window);
+		}
+		DELLK(topic_lock);
+		DELLK(unsent_lock);
 	}
 	
 	server::server(int port)
-		:_prt(port), OnClientConnect(NULL), OnClientDisconnect(NULL)
+		:_socket(NULL), _prt(port), OnClientConnect(NULL), OnClientDisconnect(NULL)
 			,OnClientError(NULL), OnClientRead(NULL), OnError(NULL)
-			,OnClientCreated(NULL){
+			,OnClientCreated(NULL), _wheel(TIMER_RESOLUTION), _timer(NULL)
+			,_idleTimeout(0), _heartbeatInterval(0), _capture(NULL), _sharedMemory(false), _subscriptions(false)
+			,_workers(0), _maxClientQueued(DEFAULT_MAX_CLIENT_QUEUED), _window(NULL), _resumePosted(0), OnClientMessage(NULL)
+			,OnClientIdleTimeout(NULL), OnClientSendTimeout(NULL){
+		INITLK(topic_lock);
+		INITLK(unsent_lock);
+		_pool.MaxQueued() = DEFAULT_MAX_QUEUED;
+		_pool.OnResume = _onresume;
 	}
 	
 	bool server::stop(){
 		bool output = false;
 		if(_socket != NULL){
+			//no worker may still be using a client when the clients are deleted
+			for(int i = 0; i < _socket->Socket->ActiveConnections; i++){
+				reinterpret_cast<serverClientSocket*>(_socket->Socket->Connections[i])->_strand.close();
+			}
+			_throttled.clear();
+			{
+				CRTLK(unsent_lock);
+				_unsent.clear();
+			}
 			try{
 				_socket->Close();
 			}catch(...){}
@@ -244,6 +760,13 @@ namespace TCP{
 			_socket = NULL;
 			output = true;
 		}
+		_pool.stop();
+		
+		//the client sockets are gone, so are their subscriptions
+		CRTLK(topic_lock);
+		_exact.clear();
+		_prefix.clear();
+		
 		return output;
 	}
 	
@@ -259,6 +782,13 @@ namespace TCP{
 			_socket->OnClientDisconnect = _onclientdisconnect;
 			_socket->OnClientError = _onclienterror;
 			
+			if(_workers > 0){
+				if(_window == NULL){
+					_window = AllocateHWnd(windowProc);
+				}
+				_pool.start(_workers);
+			}
+			
 			try{
 				_socket->Open();
 				output = true;
@@ -279,32 +809,93 @@ namespace TCP{
 	
 	void __fastcall server::_ongetclientsocket(TObject * Sender, int socket, TServerClientWinSocket* &ClientSocket){
 		ClientSocket = new serverClientSocket(socket, _socket->Socket);
+		reinterpret_cast<serverClientSocket*>(ClientSocket)->_server = this;
 		if(OnClientCreated != NULL){
 			OnClientCreated(reinterpret_cast<serverClientSocket*>(ClientSocket));
 		}
 	}
 	
 	void __fastcall server::_onclientconnect(TObject* Sender, TCustomWinSocket *Socket){
+		if(_idleTimeout > 0 || _heartbeatInterval > 0){
+			serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(Socket);
+			startTimer();
+			clnt->_data.startTimers(_wheel, _idleTimeout, _heartbeatInterval, _onclientidletimer, _onclientheartbeattimer, clnt);
+		}
+		reinterpret_cast<serverClientSocket*>(Socket)->_data.startCapture(_capture, Socket->RemoteAddress);
+		if(_pool.isRunning()){
+			serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(Socket);
+			clnt->_strand.OnMessage = _onclientmessage;
+			clnt->_strand.OnResume = _onresume;
+			clnt->_strand.Data = clnt;
+			clnt->_strand.MaxQueued() = _maxClientQueued;
+			clnt->_strand.open(&_pool);
+		}
 		if(OnClientConnect != NULL){
 			OnClientConnect(reinterpret_cast<serverClientSocket*>(Socket));
 		}
 	}
 	
 	void __fastcall server::_onclientdisconnect(TObject* Sender, TCustomWinSocket *Socket){
+		//wait for the client's message being handled, and drop the rest
+		reinterpret_cast<serverClientSocket*>(Socket)->_strand.close();
+		_throttled.erase(reinterpret_cast<serverClientSocket*>(Socket));
+		{
+			//no worker can queue to it any more
+			CRTLK(unsent_lock);
+			_unsent.erase(reinterpret_cast<serverClientSocket*>(Socket));
+		}
 		if(OnClientDisconnect != NULL){
 			OnClientDisconnect(reinterpret_cast<serverClientSocket*>(Socket));
 		}
+		unsubscribeAll(reinterpret_cast<serverClientSocket*>(Socket));
+		reinterpret_cast<serverClientSocket*>(Socket)->_data.cancelTimers();
+		reinterpret_cast<serverClientSocket*>(Socket)->_data.stopCapture();
+		reinterpret_cast<serverClientSocket*>(Socket)->_data.closeShared();
 	}
 	
 	void __fastcall server::_onclientread(TObject* Sender, TCustomWinSocket* Socket){
-		reinterpret_cast<serverClientSocket*>(Socket)->_data.readSocket(Socket);
-		if(OnClientRead != NULL){
-			OnClientRead(reinterpret_cast<serverClientSocket*>(Socket));
+		serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(Socket);
+		//the data is left in the socket, so the client backs up until the workers catch up
+		if(clnt->_throttled){
+			return;
+		}
+		clnt->_data.readSocket(Socket);
+		//only a client on this host can have created the channel it offers
+		bool acceptOffers = _sharedMemory && clnt->_data.shmState == SHM_UNKNOWN && IsLocalConnection(clnt);
+		clnt->_data.updateShared(clnt, acceptOffers, _onclientsharedread, _onclientsharedwrite, clnt);
+		takeControls(clnt);
+		if(dispatching()){
+			dispatchMessages(clnt);
+		}else if(OnClientRead != NULL){
+			OnClientRead(clnt);
+		}
+	}
+	
+	void server::_onclientsharedread(SharedMemoryChannel* channel){
+		serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(channel->Data);
+		//the ring is not re-armed, so nothing more is signalled until the client is resumed
+		if(clnt->_throttled){
+			return;
+		}
+		clnt->_data.readShared();
+		takeControls(clnt);
+		if(dispatching()){
+			dispatchMessages(clnt);
+		}else if(OnClientRead != NULL){
+			OnClientRead(clnt);
 		}
 	}
 	
+	void server::_onclientsharedwrite(SharedMemoryChannel* channel){
+		serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(channel->Data);
+		CriticalLock lock(&clnt->_data.out_stream_lock);
+		clnt->_data.sendOut(clnt);
+	}
+	
 	void __fastcall server::_onclientwrite(TObject* Sender, TCustomWinSocket* Socket){
-		reinterpret_cast<serverClientSocket*>(Socket)->_data.sendOut(Socket);
+		serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(Socket);
+		CriticalLock lock(&clnt->_data.out_stream_lock);
+		clnt->_data.sendOut(Socket);
 	}
 	
 	void __fastcall server::_onclienterror(TObject* Sender, TCustomWinSocket* Socket, TErrorEvent ev, int& ErrorCode){
@@ -348,16 +939,16 @@ namespace TCP{
 	
 	bool server::getMessageFromClient(int at, std::vector<unsigned char>& message){
 		serverClientSocket* clnt = getClient(at);
-		return clnt == NULL ? false : clnt->_data.getMessage(message);
+		return clnt == NULL ? false : clnt->getMessage(message);
 	}
 	
-	int server::sendToAll(const unsigned char * buffer, const unsigned int& length){
+	int server::sendToAll(const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority){
 		int output = -1;
 		if(_socket != NULL){
 			output = 0;
 			int i = _socket->Socket->ActiveConnections;
 			while(i-- > 0){
-				if(reinterpret_cast<serverClientSocket*>(_socket->Socket->Connections[i])->send(buffer,length)){
+				if(reinterpret_cast<serverClientSocket*>(_socket->Socket->Connections[i])->send(buffer,length,priority)){
 					output++;
 				}
 			}
@@ -365,4 +956,257 @@ namespace TCP{
 		return output;
 	}
 
+	
+	void server::addSubscriber(topic_index& index, std::set<AnsiString>& clientTopics, serverClientSocket* client, const AnsiString& topic){
+		index[topic].insert(client);
+		clientTopics.insert(topic);
+	}
+	
+	void server::removeSubscriber(topic_index& index, std::set<AnsiString>& clientTopics, serverClientSocket* client, const AnsiString& topic){
+		topic_index::iterator fnd = index.find(topic);
+		if(fnd != index.end()){
+			fnd->second.erase(client);
+			if(fnd->second.empty()){
+				index.erase(fnd);
+			}
+		}
+		clientTopics.erase(topic);
+	}
+	
+	void server::subscribe(serverClientSocket* client, const AnsiString& topic, bool prefix){
+		if(client != NULL){
+			CRTLK(topic_lock);
+			if(prefix){
+				addSubscriber(_prefix, client->_prefixes, client, topic);
+			}else{
+				addSubscriber(_exact, client->_topics, client, topic);
+			}
+		}
+	}
+	
+	void server::unsubscribe(serverClientSocket* client, const AnsiString& topic, bool prefix){
+		if(client != NULL){
+			CRTLK(topic_lock);
+			if(prefix){
+				removeSubscriber(_prefix, client->_prefixes, client, topic);
+			}else{
+				removeSubscriber(_exact, client->_topics, client, topic);
+			}
+		}
+	}
+	
+	void server::unsubscribeAll(serverClientSocket* client){
+		if(client != NULL){
+			CRTLK(topic_lock);
+			while(!client->_topics.empty()){
+				removeSubscriber(_exact, client->_topics, client, *client->_topics.begin());
+			}
+			while(!client->_prefixes.empty()){
+				removeSubscriber(_prefix, client->_prefixes, client, *client->_prefixes.begin());
+			}
+		}
+	}
+	
+	void server::processControl(serverClientSocket* client, const unsigned char* message, const unsigned int& length){
+		if(length > 0 && _subscriptions){
+			AnsiString topic((const char*)message+1, length-1);
+			switch(message[0]){
+				case CONTROL_SUBSCRIBE:				subscribe(client, topic, false);	break;
+				case CONTROL_SUBSCRIBE_PREFIX:		subscribe(client, topic, true);		break;
+				case CONTROL_UNSUBSCRIBE:			unsubscribe(client, topic, false);	break;
+				case CONTROL_UNSUBSCRIBE_PREFIX:	unsubscribe(client, topic, true);	break;
+			}
+		}
+	}
+	
+	int server::publish(const AnsiString& topic, const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority){
+		int output = -1;
+		if(_socket != NULL){
+			output = 0;
+			
+			//frame the message once, every subscriber gets a copy of the same bytes
+			StreamBuffer<unsigned char> frame(length+8);
+			WriteMessageToStreamBuffer(frame, buffer, length);
+			
+			CRTLK(topic_lock);
+			
+			//collect the subscribers, a client subscribed more than once only gets the message once
+			subscriber_set targets;
+			topic_index::iterator fnd = _exact.find(topic);
+			if(fnd != _exact.end()){
+				targets.insert(fnd->second.begin(), fnd->second.end());
+			}
+			//look up each prefix of the topic, rather than checking every prefix subscription
+			if(!_prefix.empty()){
+				for(int i = 0; i <= topic.Length(); i++){
+					fnd = _prefix.find(topic.SubString(1, i));
+					if(fnd != _prefix.end()){
+						targets.insert(fnd->second.begin(), fnd->second.end());
+					}
+				}
+			}
+			
+			for(subscriber_set::iterator ittr = targets.begin(); ittr != targets.end(); ittr++){
+				if((*ittr)->sendFramed(frame, priority)){
+					output++;
+				}
+			}
+		}
+		return output;
+	}
+
+	
+	bool server::mustThrottle(serverClientSocket* client){
+		return (client->_strand.full() && client->_strand.throttle()) || (_pool.full() && _pool.throttle());
+	}
+	
+	void server::dispatchMessages(serverClientSocket* client){
+		for(;;){
+			//messages left in the instream are dispatched when the client is resumed
+			if(mustThrottle(client)){
+				client->_throttled = true;
+				_throttled.insert(client);
+				break;
+			}
+			std::vector<unsigned char>* message = new std::vector<unsigned char>();
+			if(!client->getMessage(*message)){
+				delete message;
+				break;
+			}
+			client->_strand.add(message);
+		}
+	}
+	
+	void server::resumeReads(){
+		//cleared first, so a resume while the clients are read posts again
+		InterlockedExchange((LONG*)&_resumePosted, 0);
+		std::set<serverClientSocket*> throttled;
+		throttled.swap(_throttled);
+		for(std::set<serverClientSocket*>::iterator ittr = throttled.begin(); ittr != throttled.end(); ittr++){
+			serverClientSocket* clnt = *ittr;
+			if(mustThrottle(clnt)){
+				//its strand has not drained, or the workers fell behind again, it waits for the next resume
+				_throttled.insert(clnt);
+				continue;
+			}
+			clnt->_throttled = false;
+			//the time spent throttled doesn't count towards the idle timeout
+			clnt->_data.lastRead = GetTickCount();
+			if(clnt->_data.shmState == SHM_ON){
+				_onclientsharedread(clnt->_data.shm);
+			}else{
+				_onclientread(NULL, clnt);
+			}
+		}
+	}
+	
+	void server::takeControls(serverClientSocket* client){
+		std::vector<std::vector<unsigned char> > controls;
+		client->_data.takeControls(controls);
+		for(unsigned int i = 0; i < controls.size(); i++){
+			processControl(client, controls[i].begin(), controls[i].size());
+		}
+	}
+	
+	void server::_onclientmessage(WorkerStrand* strand, std::vector<unsigned char>& message){
+		if(OnClientMessage != NULL){
+			OnClientMessage(reinterpret_cast<serverClientSocket*>(strand->Data), message);
+		}
+	}
+	
+	void server::_onresume(QueueLimit* limit){
+		//called on a worker thread for the pool or a client's strand, the clients are read on the VCL thread
+		if(!InterlockedExchange((LONG*)&_resumePosted, 1)){
+			PostMessage(_window, WM_RESUME_READS, 0, 0);
+		}
+	}
+	
+	void server::postSend(serverClientSocket* client){
+		CRTLK(unsent_lock);
+		//one message sends every client queued before it is handled
+		if(_unsent.empty()){
+			PostMessage(_window, WM_SEND_CLIENTS, 0, 0);
+		}
+		_unsent.insert(client);
+	}
+	
+	void server::sendQueued(){
+		for(;;){
+			serverClientSocket* clnt;
+			{
+				//one at a time, a client disconnected by a failed send is removed from the set
+				CRTLK(unsent_lock);
+				if(_unsent.empty()){
+					break;
+				}
+				clnt = *_unsent.begin();
+				_unsent.erase(_unsent.begin());
+			}
+			CriticalLock lock(&clnt->_data.out_stream_lock);
+			clnt->_data.sendOut(clnt);
+		}
+	}
+	
+	void __fastcall server::windowProc(Messages::TMessage& message){
+		if(message.Msg == WM_RESUME_READS){
+			resumeReads();
+		}else if(message.Msg == WM_SEND_CLIENTS){
+			sendQueued();
+		}else{
+			message.Result = DefWindowProc(_window, message.Msg, message.WParam, message.LParam);
+		}
+	}
+	
+	void server::armSendDeadline(serverClientSocket* client, MESSAGE_PRIORITY priority, const unsigned int& milliseconds){
+		startTimer();
+		client->_data.addDeadline(_wheel, priority, milliseconds, _onclientsenddeadline, client);
+	}
+	
+	void server::startTimer(){
+		if(_timer == NULL){
+			_wheel.start(GetTickCount());
+			_timer = new TTimer(NULL);
+			_timer->Interval = _wheel.resolution();
+			_timer->OnTimer = _ontimer;
+		}
+	}
+	
+	void __fastcall server::_ontimer(TObject* Sender){
+		_wheel.advance(GetTickCount());
+	}
+	
+	void server::_onclientidletimer(TimerNode* timer){
+		serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(timer->Data);
+		//a throttled client is not read because the server chose not to, not because it went quiet
+		if(clnt->_throttled){
+			_wheel.arm(&clnt->_data.idleTimer, _idleTimeout);
+			return;
+		}
+		if(clnt->_data.checkIdle(_wheel, _idleTimeout)){
+			if(OnClientIdleTimeout == NULL){
+				clnt->Close();
+			}else{
+				//re-arm first, closing the client from the event cancels it again
+				_wheel.arm(&clnt->_data.idleTimer, _idleTimeout);
+				OnClientIdleTimeout(clnt);
+			}
+		}
+	}
+	
+	void server::_onclientheartbeattimer(TimerNode* timer){
+		serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(timer->Data);
+		clnt->_data.heartbeat(clnt, _wheel, _heartbeatInterval);
+	}
+	
+	void server::_onclientsenddeadline(TimerNode* timer){
+		serverClientSocket* clnt = reinterpret_cast<serverClientSocket*>(timer->Data);
+		if(clnt->_data.expireDeadline(static_cast<SendDeadline*>(timer))){
+			if(OnClientSendTimeout == NULL){
+				clnt->Close();
+			}else{
+				OnClientSendTimeout(clnt);
+			}
+		}
+	}
+
 }; //end namespace TCP
@@ -3,8 +3,17 @@
 
 #include "buffer.h"
 #include <ScktComp.hpp>
+#include <ExtCtrls.hpp>
 #include "CriticalLock.h"
+#include "TimerWheel.h"
+#include "Capture.h"
+#include "SharedMemory.h"
+#include "WorkerPool.h"
 #include <fstream>
+#include <map>
+#include <set>
+#include <list>
+#include <deque>
 
 namespace TCP{
 	//client connection status
@@ -17,21 +26,98 @@ namespace TCP{
 		CONNECTION_DISCONNECTED
 	};
 	
+	//priority of an outgoing message
+	//queued messages are sent highest priority first, a message is never split by a higher priority one
+	enum MESSAGE_PRIORITY{
+		PRIORITY_HIGH,
+		PRIORITY_NORMAL,
+		PRIORITY_BULK,
+		PRIORITY_COUNT
+	};
+	
+	//bytes moved from the priority lanes to the outstream at once, rounded up to a whole message
+	//a high priority message waits for the data already in the outstream, so for the larger of this and the largest message queued
+	//messages are not split, a single bulk message of many megabytes is sent whole before anything queued after it
+	const unsigned int OUTSTREAM_BATCH = 65536;
+	
+	//milliseconds per tick of the timer wheel used for idle timeouts, heartbeats and send deadlines
+	const unsigned int TIMER_RESOLUTION = 50;
+	
+	//messages waiting for one client's worker before the server stops reading that client
+	const LONG DEFAULT_MAX_CLIENT_QUEUED = 1000;
+	//messages waiting for all the server's workers before it stops reading every client
+	const LONG DEFAULT_MAX_QUEUED = 100000;
+	//posted to the server's window when the workers have caught up
+	const unsigned int WM_RESUME_READS = WM_USER + 3;
+	//posted to the server's window when a worker queued messages for clients
+	const unsigned int WM_SEND_CLIENTS = WM_USER + 4;
+	
 	//chars used to construct the message
 	const char HEAD_START = 1;
 	const char TEXT_START = 2;
 	const char END_TEXT = 3;
 	const char END_TRANS = 4;
+	//starts the data of a control message instead of TEXT_START
+	//control messages are used by the library itself, and are never returned by getMessage
+	const char CONTROL_START = 14;
+	
+	//shared memory transport state of a connection
+	enum SHM_STATE{
+		SHM_UNKNOWN,	//server: waiting to see if the client's first message is an offer
+		SHM_OFF,		//sending and reading through the socket
+		SHM_OFFERED,	//client: offer sent, waiting for the server to accept or reject it
+		SHM_SWITCHING,	//server: sending through shared memory, reading the socket until the client switches
+		SHM_ON			//sending and reading through shared memory
+	};
+	
+	//milliseconds the client waits for the server to answer a shared memory offer before it stays on the socket
+	//the server answers as soon as it reads the offer, so only a server that does not know the offer misses it
+	const unsigned int SHM_ANSWER_TIMEOUT = 5000;
+	
+	//first byte of a control message, the rest of its data depends on the type
+	enum CONTROL_TYPE{
+		//followed by the topic
+		CONTROL_SUBSCRIBE,
+		CONTROL_SUBSCRIBE_PREFIX,
+		CONTROL_UNSUBSCRIBE,
+		CONTROL_UNSUBSCRIBE_PREFIX,
+		//switching a local connection to shared memory
+		//the client sends an offer followed by the channel name as its first message
+		//the server answers with accept or reject, and the client replies to an accept with switch
+		//accept and switch are the last messages the sender writes to the socket
+		CONTROL_SHM_OFFER,
+		CONTROL_SHM_ACCEPT,
+		CONTROL_SHM_REJECT,
+		CONTROL_SHM_SWITCH,
+		//sent when nothing else was sent for the heartbeat interval, no data
+		CONTROL_HEARTBEAT
+	};
+	
+	//true if the other end of the socket is on this host
+	inline bool IsLocalConnection(TCustomWinSocket* socket){
+		AnsiString address = socket->RemoteAddress;
+		return address == socket->LocalAddress || address.Pos("127.") == 1;
+	}
 	
 	//check a stream buffer for a message.
 	//If found populate the message vector with the data, and remove it from the stream buffer
+	//control messages are skipped, they are handled by the library before the messages are read
 	template<typename stream_type>
 	bool GetMessageFromStreamBuffer(StreamBuffer<stream_type>& stream, std::vector<unsigned char>& message);
 	
 	//Write the data and the message header to the given stream
 	// SOH <4-byte-data-length> STX <data-length-bytes> ETX EOT
+	//start is CONTROL_START for a control message
 	template<typename stream_type>
-	void WriteMessageToStreamBuffer(StreamBuffer<stream_type>& stream, const unsigned char * buffer, const unsigned int& length);
+	void WriteMessageToStreamBuffer(StreamBuffer<stream_type>& stream, const unsigned char * buffer, const unsigned int& length, const char& start = TEXT_START);
+	
+	//deadline for sending a message, expires on the wheel whether or not the message was sent
+	struct SendDeadline : public TimerNode{
+		MESSAGE_PRIORITY lane;
+		//bytes queued to the lane, up to and including the message
+		unsigned __int64 end;
+		std::list<SendDeadline*>::iterator position;
+	};
 	
 	//Base class for client and server client
     class client_base{
@@ -40,15 +126,67 @@ namespace TCP{
 		std::vector<unsigned char> tmpInBuff;
 		int tmpInSz;
 		
+		//bytes queued to, and sent from, each lane
+		unsigned __int64 laneQueued[PRIORITY_COUNT];
+		unsigned __int64 laneSent[PRIORITY_COUNT];
+		//the lane and length of each part of the outstream
+		std::deque<std::pair<int, unsigned int> > outSegments;
+		
+		//move whole messages from the lanes to the outstream, highest priority first
+		//at least one message is moved, even if it is larger than OUTSTREAM_BATCH
+		void fillOutstream();
+		//count bytes sent from the outstream against the lanes they came from
+		void countSent(unsigned int length);
+		
+		//bytes at the front of the outstream that still go to the socket after switching to shared memory
+		unsigned int tcpRemaining;
+		
+		//time the offer was sent, from GetTickCount
+		unsigned long shmOffered;
+		
+		//queue everything waiting in the lanes and the marker for the socket, everything queued after goes to shm
+		template<typename socket_type>
+		void switchToShared(socket_type* socket, CONTROL_TYPE marker);
+		//remove an offer from the front of the instream
+		//returns 1 if it was taken, 0 if there is not enough data yet to tell, -1 if the first message is not an offer
+		int takeOffer(AnsiString& name);
+		//walk the complete messages in the instream, and remove the first shared memory answer, accept, reject or switch
+		//returns its type, or -1 if there is none
+		int takeAnswer();
+		
 	public:
 		//the actual data
+		//outstream holds the data being written to the socket, lanes hold the messages waiting for it
 		StreamBuffer<unsigned char> outstream;
+		StreamBuffer<unsigned char> lanes[PRIORITY_COUNT];
 		StreamBuffer<unsigned char> instream;
 		
 		//locks
 		CRITICAL_SECTION in_stream_lock, out_stream_lock;
 		
+		//time of the last read, from GetTickCount
+		unsigned long lastRead;
+		//set when a message is queued, cleared by the heartbeat timer
+		bool sentSinceHeartbeat;
+		
+		//timers, armed on the owner's wheel
+		TimerNode idleTimer;
+		TimerNode heartbeatTimer;
+		std::list<SendDeadline*> deadlines;
+		
+		//capture of the data read from the socket, NULL if not capturing
+		TrafficCapture* capture;
+		unsigned int captureId;
+		
+		//shared memory transport, NULL while only the socket is used
+		SharedMemoryChannel* shm;
+		SHM_STATE shmState;
+		
 		~client_base(){
+			cancelTimers();
+			stopCapture();
+			closeShared();
+			
 			//cleanup the critical sections
 			LeaveCriticalSection(&in_stream_lock);
 			LeaveCriticalSection(&out_stream_lock);
@@ -57,19 +195,40 @@ namespace TCP{
 			DeleteCriticalSection(&out_stream_lock);
 		}
 		
-		client_base(){
+		client_base():lastRead(0),sentSinceHeartbeat(false),capture(NULL),captureId(0),
+			shm(NULL),shmState(SHM_UNKNOWN),tcpRemaining(0),shmOffered(0){
 			//initialize the critical sections
 			InitializeCriticalSection(&in_stream_lock);
 			InitializeCriticalSection(&out_stream_lock);
+			
+			for(int i = 0; i < PRIORITY_COUNT; i++){
+				laneQueued[i] = laneSent[i] = 0;
+			}
 		}
 		
 		//send data in the outstream to the socket
 		template<typename socket_type>
 		bool sendOut(socket_type* socket);
 		
-		//write data to the outstream, and send if the stream was empty
+		//write data to the priority lane without sending it
+		//returns true if the outstream was empty, so nothing already being sent will send it
+		bool queue(const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority = PRIORITY_NORMAL);
+		bool queueFramed(const StreamBuffer<unsigned char>& frame, MESSAGE_PRIORITY priority = PRIORITY_NORMAL);
+		
+		//write data to the priority lane, and send if the outstream was empty
 		template<typename socket_type>
-		bool send(socket_type* socket, const unsigned char * buffer, const unsigned int& length);
+		bool send(socket_type* socket, const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority = PRIORITY_NORMAL);
+		
+		//write an already framed message to the priority lane, and send if the outstream was empty
+		template<typename socket_type>
+		bool sendFramed(socket_type* socket, const StreamBuffer<unsigned char>& frame, MESSAGE_PRIORITY priority = PRIORITY_NORMAL);
+		
+		//send a control message, the type followed by the data
+		template<typename socket_type>
+		bool sendControl(socket_type* socket, CONTROL_TYPE type, const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority = PRIORITY_NORMAL);
+		
+		//remove all data waiting to be sent
+		void clearOutgoing();
 		
 		//read data from the socket into the instream
 		template<typename socket_type>
@@ -77,10 +236,60 @@ namespace TCP{
 		
 		//returns true or false if there is a message to get
 		//if there is a message, the vector "message" is cleared, and the message data is inserted into it.
+		//control messages, heartbeats among them, are skipped
 		bool getMessage(std::vector<unsigned char>& message){
 			CRTLK(in_stream_lock);
 			return GetMessageFromStreamBuffer(instream, message);
 		}
+		
+		//remove the subscription and heartbeat control messages from the complete messages in the instream
+		//the data of each, starting with its type, is added to controls
+		void takeControls(std::vector<std::vector<unsigned char> >& controls);
+		
+		//arm the idle and heartbeat timers, a time of 0 leaves that timer disarmed
+		void startTimers(TimerWheel& wheel, const unsigned int& idleTimeout, const unsigned int& heartbeatInterval, TimerNode::Event onIdle, TimerNode::Event onHeartbeat, void* data);
+		
+		//returns true if nothing was read for the idle timeout
+		//otherwise the idle timer is re-armed for the time left, so reads never have to touch the timer
+		bool checkIdle(TimerWheel& wheel, const unsigned int& idleTimeout);
+		
+		//send a heartbeat control message if nothing was sent since the last one, and re-arm the heartbeat timer
+		template<typename socket_type>
+		void heartbeat(socket_type* socket, TimerWheel& wheel, const unsigned int& heartbeatInterval);
+		
+		//arm a deadline for the last message written to the lane
+		//nothing is armed if the message was already sent
+		void addDeadline(TimerWheel& wheel, MESSAGE_PRIORITY priority, const unsigned int& milliseconds, TimerNode::Event onExpire, void* data);
+		
+		//called when a deadline expires, the deadline is deleted
+		//returns true if its message is still not sent
+		bool expireDeadline(SendDeadline* deadline);
+		
+		//disarm all timers, and delete the deadlines
+		void cancelTimers();
+		
+		//record everything read from the socket to the capture, does nothing if the capture is NULL or not open
+		void startCapture(TrafficCapture* trafficCapture, const AnsiString& address);
+		void stopCapture();
+		
+		//true once messages are sent through shared memory
+		bool sendingShared() const{	return shm != NULL && (shmState == SHM_SWITCHING || shmState == SHM_ON);	}
+		
+		//create a shared memory channel and offer it to the server, the connection keeps using the socket until it is accepted
+		template<typename socket_type>
+		void offerShared(socket_type* socket, SharedMemoryChannel::Event onRead, SharedMemoryChannel::Event onWrite, void* data);
+		
+		//handle the shared memory messages after reading the socket
+		//acceptOffers is false to reject offers from the other side
+		//an offer that is not answered within SHM_ANSWER_TIMEOUT is given up, and the socket is used
+		template<typename socket_type>
+		void updateShared(socket_type* socket, bool acceptOffers, SharedMemoryChannel::Event onRead, SharedMemoryChannel::Event onWrite, void* data);
+		
+		//read data from the shared memory channel into the instream
+		void readShared();
+		
+		//close the channel, and go back to the socket
+		void closeShared();
 	};
 	
 	//TCP Client class
@@ -99,9 +308,32 @@ namespace TCP{
 		CONNECTION_STATUS _constat;
 		AnsiString _lastException;
 		
+		//timers, the TTimer is only created once a timer is used
+		TimerWheel _wheel;
+		TTimer* _timer;
+		unsigned int _idleTimeout;
+		unsigned int _heartbeatInterval;
+		
+		TrafficCapture* _capture;
+		
+		bool _sharedMemory;
+		
 		//initialize a new socket
 		void createNewSocket();
 		
+		//send a subscription control message
+		bool sendSubscription(CONTROL_TYPE type, const AnsiString& topic);
+		
+		void _onsharedread(SharedMemoryChannel* channel);
+		void _onsharedwrite(SharedMemoryChannel* channel);
+		
+		//create the TTimer driving the wheel
+		void startTimer();
+		void __fastcall _ontimer(TObject* Sender);
+		void _onidletimer(TimerNode* timer);
+		void _onheartbeattimer(TimerNode* timer);
+		void _onsenddeadline(TimerNode* timer);
+		
 		//events
 		virtual void __fastcall _onconnect(TObject* Sender, TCustomWinSocket *Socket);
 		virtual void __fastcall _ondisconnect(TObject* Sender, TCustomWinSocket *Socket);
@@ -124,6 +356,27 @@ namespace TCP{
 		CONNECTION_STATUS connectionStatus() const{	return _constat;	}
 		const AnsiString& getLastException() const{	return _lastException;	}
 		
+		//milliseconds without reading anything before OnIdleTimeout, 0 to disable
+		//set before connecting
+		const unsigned int& IdleTimeout() const{	return _idleTimeout;	}
+		unsigned int& IdleTimeout(){	return _idleTimeout;	}
+		//milliseconds without sending anything before a heartbeat is sent, 0 to disable
+		//a heartbeat is a control message, it is never returned by getMessage
+		//set before connecting
+		const unsigned int& HeartbeatInterval() const{	return _heartbeatInterval;	}
+		unsigned int& HeartbeatInterval(){	return _heartbeatInterval;	}
+		
+		//capture the data read from the server, NULL to disable
+		//set before connecting, the capture must outlive the connection
+		TrafficCapture* const& Capture() const{	return _capture;	}
+		TrafficCapture*& Capture(){	return _capture;	}
+		
+		//use shared memory instead of the socket when the server is on the same host and allows it
+		//set before connecting
+		const bool& SharedMemory() const{	return _sharedMemory;	}
+		bool& SharedMemory(){	return _sharedMemory;	}
+		bool usingSharedMemory() const{	return shmState == SHM_ON;	}
+		
 		//connect to a socket
 		//returns false if already connected, or waiting for one
 		bool connect();
@@ -135,8 +388,14 @@ namespace TCP{
 		bool disconnect();
 
 		//send data to the socket
-		//returns false if not connected or the send failed
-		bool send(const unsigned char * buffer, const unsigned int& length);
+		//if deadline is not 0, OnSendTimeout is called if the message is not sent within that many milliseconds
+		//returns false if not connected, or if the send failed or filled the socket, in which case the message is still queued
+		bool send(const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority = PRIORITY_NORMAL, const unsigned int& deadline = 0);
+		
+		//ask the server to send messages published to the topic, the server must have Subscriptions() set
+		//if prefix is true, every topic starting with "topic" is matched
+		bool subscribe(const AnsiString& topic, bool prefix = false);
+		bool unsubscribe(const AnsiString& topic, bool prefix = false);
 		
 		//retreive a message from the input buffer
 		bool getMessage(std::vector<unsigned char>& message){
@@ -150,22 +409,45 @@ namespace TCP{
 		Event OnRead;
 		//If OnError is not set, the connection will attempt to close on any error
 		ErrorEvent OnError;
+		//If OnIdleTimeout is not set, the connection will close when idle
+		//otherwise it is called again every IdleTimeout while the connection stays idle
+		Event OnIdleTimeout;
+		//If OnSendTimeout is not set, the connection will close when a send deadline is missed
+		Event OnSendTimeout;
 	};
 	
+	class server;
+	
 	//the client connection used by the server
 	class serverClientSocket : public TServerClientWinSocket{
 	public:
 		//the data, and methods for sending/receiving it
 		client_base _data;
 		
+		//the server that accepted this client
+		server* _server;
+		
+		//topics this client is subscribed to, used to clean up the server's topic index
+		std::set<AnsiString> _topics;
+		std::set<AnsiString> _prefixes;
+		
+		//messages waiting for the server's workers
+		WorkerStrand _strand;
+		//set while the client is not read because its strand or the pool is full
+		bool _throttled;
+		
 		//the constructor must have these parameters and call the TServerClientWinSocket constructor
 		__fastcall serverClientSocket(int socket, TServerWinSocket* serverWinSocket):
-			TServerClientWinSocket(socket, serverWinSocket){
+			TServerClientWinSocket(socket, serverWinSocket), _server(NULL), _throttled(false){
 		}
 		
 		//send data to the socket
+		//if deadline is not 0, the server's OnClientSendTimeout is called if the message is not sent within that many milliseconds
 		//returns false if the sed command failed
-		bool send(const unsigned char * buffer, const unsigned int& length);
+		bool send(const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority = PRIORITY_NORMAL, const unsigned int& deadline = 0);
+		
+		//send an already framed message
+		bool sendFramed(const StreamBuffer<unsigned char>& frame, MESSAGE_PRIORITY priority = PRIORITY_NORMAL);
 		
 		//retreive a message from the input buffer
 		bool getMessage(std::vector<unsigned char>& message){
@@ -178,6 +460,10 @@ namespace TCP{
 	public:
 		typedef void (__closure* clientEvent)(serverClientSocket* client);
 		typedef void (__closure* clientErrorEvent)(serverClientSocket* client, TErrorEvent ev, int& ErrorCode);
+		typedef void (__closure* clientMessageEvent)(serverClientSocket* client, std::vector<unsigned char>& message);
+		
+		typedef std::set<serverClientSocket*> subscriber_set;
+		typedef std::map<AnsiString, subscriber_set> topic_index;
 		
 	protected:
 		//the actual socket
@@ -185,6 +471,64 @@ namespace TCP{
 		
 		//the port
 		int _prt;
+		
+		//subscribers by exact topic, and by topic prefix
+		topic_index _exact;
+		topic_index _prefix;
+		CRITICAL_SECTION topic_lock;
+		
+		//add or remove a client from one of the topic indexes
+		void addSubscriber(topic_index& index, std::set<AnsiString>& clientTopics, serverClientSocket* client, const AnsiString& topic);
+		void removeSubscriber(topic_index& index, std::set<AnsiString>& clientTopics, serverClientSocket* client, const AnsiString& topic);
+		
+		//timers for every client, the TTimer is only created once a timer is used
+		TimerWheel _wheel;
+		TTimer* _timer;
+		unsigned int _idleTimeout;
+		unsigned int _heartbeatInterval;
+		
+		TrafficCapture* _capture;
+		
+		bool _sharedMemory;
+		bool _subscriptions;
+		
+		void _onclientsharedread(SharedMemoryChannel* channel);
+		void _onclientsharedwrite(SharedMemoryChannel* channel);
+		
+		//threads handling client messages
+		WorkerPool _pool;
+		unsigned int _workers;
+		LONG _maxClientQueued;
+		//clients not being read until the workers catch up, only used on the VCL thread
+		std::set<serverClientSocket*> _throttled;
+		HWND _window;
+		//set while a WM_RESUME_READS is waiting, so a burst of resumes is handled once
+		volatile LONG _resumePosted;
+		//clients a worker queued messages for, sent on the VCL thread
+		std::set<serverClientSocket*> _unsent;
+		CRITICAL_SECTION unsent_lock;
+		
+		bool dispatching() const{	return _pool.isRunning() && OnClientMessage != NULL;	}
+		//true if the client's strand or the pool is full, then OnResume is called once it drains
+		bool mustThrottle(serverClientSocket* client);
+		//move the client's messages to its strand, and stop reading the client if the workers are behind
+		void dispatchMessages(serverClientSocket* client);
+		//read the throttled clients that can be read again
+		void resumeReads();
+		//apply the control messages read from the client, before the application reads its messages
+		void takeControls(serverClientSocket* client);
+		//send what the workers queued
+		void sendQueued();
+		void _onclientmessage(WorkerStrand* strand, std::vector<unsigned char>& message);
+		void _onresume(QueueLimit* limit);
+		void __fastcall windowProc(Messages::TMessage& message);
+		
+		//create the TTimer driving the wheel
+		void startTimer();
+		void __fastcall _ontimer(TObject* Sender);
+		void _onclientidletimer(TimerNode* timer);
+		void _onclientheartbeattimer(TimerNode* timer);
+		void _onclientsenddeadline(TimerNode* timer);
 	
 		//client events
 		virtual void __fastcall _ongetclientsocket(TObject * Sender, int socket, TServerClientWinSocket* &ClientSocket);
@@ -204,6 +548,43 @@ namespace TCP{
 		const int& Port() const{	return _prt;	}
 		int& Port(){	return _prt;	}
 		
+		//milliseconds without reading anything from a client before OnClientIdleTimeout, 0 to disable
+		//time a client spends throttled by MaxQueuedPerClient or MaxQueued doesn't count
+		//applies to clients connecting after it is set
+		const unsigned int& IdleTimeout() const{	return _idleTimeout;	}
+		unsigned int& IdleTimeout(){	return _idleTimeout;	}
+		//milliseconds without sending anything to a client before a heartbeat is sent, 0 to disable
+		//a heartbeat is a control message, it is never returned by getMessage
+		//applies to clients connecting after it is set
+		const unsigned int& HeartbeatInterval() const{	return _heartbeatInterval;	}
+		unsigned int& HeartbeatInterval(){	return _heartbeatInterval;	}
+		
+		//capture the data read from every client, NULL to disable
+		//applies to clients connecting after it is set, the capture must outlive the server
+		TrafficCapture* const& Capture() const{	return _capture;	}
+		TrafficCapture*& Capture(){	return _capture;	}
+		
+		//accept shared memory offers from clients on the same host
+		const bool& SharedMemory() const{	return _sharedMemory;	}
+		bool& SharedMemory(){	return _sharedMemory;	}
+		
+		//apply subscriptions sent by client::subscribe/unsubscribe, they never reach the application either way
+		const bool& Subscriptions() const{	return _subscriptions;	}
+		bool& Subscriptions(){	return _subscriptions;	}
+		
+		//threads calling OnClientMessage, 0 to handle messages on the VCL thread with OnClientRead
+		//set before listening
+		const unsigned int& Workers() const{	return _workers;	}
+		unsigned int& Workers(){	return _workers;	}
+		//messages from one client waiting for the workers before that client stops being read, 0 for no limit
+		//reading resumes once half of them are handled, applies to clients connecting after it is set
+		const LONG& MaxQueuedPerClient() const{	return _maxClientQueued;	}
+		LONG& MaxQueuedPerClient(){	return _maxClientQueued;	}
+		//messages from all clients waiting for the workers before every client stops being read, 0 for no limit
+		//a ceiling in case many clients are each below MaxQueuedPerClient, reading resumes once half of them are handled
+		const LONG& MaxQueued() const{	return _pool.MaxQueued();	}
+		LONG& MaxQueued(){	return _pool.MaxQueued();	}
+		
 		//host name
 		AnsiString getHostname(){	return (_socket != NULL)?_socket->Socket->LocalHost:AnsiString("<NULL>");	}
 		
@@ -227,14 +608,49 @@ namespace TCP{
 		bool getMessageFromClient(int at, std::vector<unsigned char>& message);
 		
 		//send a message to all connected clients
-		int sendToAll(const unsigned char * buffer, const unsigned int& length);
+		int sendToAll(const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority = PRIORITY_NORMAL);
+		
+		//add/remove a client to/from a topic
+		//if prefix is true, the client receives every topic starting with "topic"
+		void subscribe(serverClientSocket* client, const AnsiString& topic, bool prefix = false);
+		void unsubscribe(serverClientSocket* client, const AnsiString& topic, bool prefix = false);
+		//remove a client from every topic, called automatically when the client disconnects
+		void unsubscribeAll(serverClientSocket* client);
+		
+		//apply a control message from the client, called when the client is read
+		//subscriptions are ignored unless Subscriptions() is set
+		void processControl(serverClientSocket* client, const unsigned char* message, const unsigned int& length);
+		
+		//send a message to every client subscribed to the topic, the message is only framed once
+		//returns the number of clients the message was sent to, or -1 if the server is not listening
+		int publish(const AnsiString& topic, const unsigned char * buffer, const unsigned int& length, MESSAGE_PRIORITY priority = PRIORITY_NORMAL);
+		
+		//arm a deadline for the last message sent to the client at that priority, used by serverClientSocket::send
+		void armSendDeadline(serverClientSocket* client, MESSAGE_PRIORITY priority, const unsigned int& milliseconds);
+		
+		//true on one of the worker threads, where clients are only queued to, used by serverClientSocket::send
+		bool isWorker() const{	return _pool.isWorker();	}
+		//send the client's queued messages from the VCL thread, used by serverClientSocket::send on a worker
+		void postSend(serverClientSocket* client);
 		
 		//client events
 		clientEvent OnClientConnect;
 		clientEvent OnClientDisconnect;
 		clientEvent OnClientRead;
+		//If Workers is not 0 and OnClientMessage is set, it is called on a worker thread for every message instead of OnClientRead
+		//messages from one client are handled one at a time in order, different clients in parallel
+		//the client can be sent to from the worker, but without a deadline, and it must be closed from the VCL thread
+		//a send from a worker is queued, and written to the socket on the VCL thread, so it never raises socket events on the worker
+		//the VCL thread may wait for a worker when a client disconnects, so OnClientMessage must never wait for the VCL thread,
+		//with TThread::Synchronize, SendMessage or otherwise
+		clientMessageEvent OnClientMessage;
 		//If OnClientError is not set, the connection will attempt to close on any error
 		clientErrorEvent OnClientError;
+		//If OnClientIdleTimeout is not set, the client will be closed when idle
+		//otherwise it is called again every IdleTimeout while the client stays idle
+		clientEvent OnClientIdleTimeout;
+		//If OnClientSendTimeout is not set, the client will be closed when a send deadline is missed
+		clientEvent OnClientSendTimeout;
 		
 		clientEvent OnClientCreated;
 		
@@ -0,0 +1,205 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <cstddef>
+
+class TimerWheel;
+
+//A timer which can be armed on a TimerWheel.
+//The node is linked directly into the wheel's slot, so arming and cancelling are O(1) and never allocate.
+//The timer cancels itself when destroyed.
+struct TimerNode{
+	typedef void (__closure* Event)(TimerNode* timer);
+
+	TimerNode* _prev;
+	TimerNode* _next;
+	TimerWheel* _wheel;
+	unsigned int _expires;
+
+	//called when the timer expires, the timer is no longer armed at that point and may be re-armed
+	Event OnExpire;
+	//user data, usually the owner of the timer
+	void* Data;
+
+	TimerNode():_prev(NULL),_next(NULL),_wheel(NULL),_expires(0),OnExpire(NULL),Data(NULL){}
+	virtual ~TimerNode(){	cancel();	}
+
+	bool armed() const{	return _wheel != NULL;	}
+	inline void cancel();
+
+private:
+	//the node is linked into a list, copying it would corrupt the list
+	TimerNode(const TimerNode& other);
+	TimerNode& operator=(const TimerNode& other);
+};
+
+//Hierarchical timer wheel.
+//LEVELS wheels of SLOTS slots each, every level covers SLOTS times the range of the one below it.
+//Timers are placed in the lowest level that can hold them, and moved down a level when the level below wraps.
+//Nothing is done for a tick unless a slot has timers, and ticks are skipped entirely while no timer is armed.
+class TimerWheel{
+public:
+	enum{
+		LEVELS = 4,
+		SLOT_BITS = 6,
+		SLOTS = 1 << SLOT_BITS,
+		SLOT_MASK = SLOTS - 1,
+		//longest delay in ticks, longer delays are shortened to this
+		MAX_TICKS = (1 << (LEVELS*SLOT_BITS)) - 1
+	};
+
+protected:
+	//list heads
+	TimerNode _slots[LEVELS][SLOTS];
+	//the next tick to be processed
+	unsigned int _now;
+	//number of armed timers
+	unsigned int _count;
+	//milliseconds per tick
+	unsigned int _resolution;
+	//time of the last processed tick, in milliseconds
+	unsigned long _last;
+
+	static void init(TimerNode* head){
+		head->_prev = head->_next = head;
+	}
+	static void link(TimerNode* head, TimerNode* node){
+		node->_next = head;
+		node->_prev = head->_prev;
+		head->_prev->_next = node;
+		head->_prev = node;
+	}
+	static void unlink(TimerNode* node){
+		node->_prev->_next = node->_next;
+		node->_next->_prev = node->_prev;
+		node->_prev = node->_next = NULL;
+	}
+	//move every node from one list to another empty list
+	static void splice(TimerNode* from, TimerNode* to){
+		if(from->_next != from){
+			to->_next = from->_next;
+			to->_prev = from->_prev;
+			to->_next->_prev = to;
+			to->_prev->_next = to;
+			init(from);
+		}
+	}
+
+	void place(TimerNode* node){
+		unsigned int delta = node->_expires - _now;
+		int level = 0;
+		while(level < LEVELS-1 && delta >= (1u << ((level+1)*SLOT_BITS))){
+			level++;
+		}
+		link(&_slots[level][(node->_expires >> (level*SLOT_BITS)) & SLOT_MASK], node);
+	}
+
+	//re-place the timers of a slot, they all end up in lower levels
+	void cascade(int level, unsigned int slot){
+		TimerNode moving;
+		init(&moving);
+		splice(&_slots[level][slot], &moving);
+		while(moving._next != &moving){
+			TimerNode* node = moving._next;
+			unlink(node);
+			place(node);
+		}
+	}
+
+	//process one tick, firing the timers that expire on it
+	void tick(){
+		unsigned int index = _now & SLOT_MASK;
+		//when a level wraps, move the timers of the next level's current slot down
+		for(int level = 1; index == 0 && level < LEVELS; level++){
+			index = (_now >> (level*SLOT_BITS)) & SLOT_MASK;
+			cascade(level, index);
+		}
+
+		TimerNode expired;
+		init(&expired);
+		splice(&_slots[0][_now & SLOT_MASK], &expired);
+		_now++;
+
+		//a callback may cancel or re-arm any timer, including ones still in the expired list
+		while(expired._next != &expired){
+			TimerNode* node = expired._next;
+			unlink(node);
+			node->_wheel = NULL;
+			_count--;
+			if(node->OnExpire != NULL){
+				node->OnExpire(node);
+			}
+		}
+	}
+
+public:
+	TimerWheel(const unsigned int& resolution = 50):_now(0),_count(0),_resolution(resolution?resolution:1),_last(0){
+		for(int level = 0; level < LEVELS; level++){
+			for(int slot = 0; slot < SLOTS; slot++){
+				init(&_slots[level][slot]);
+			}
+		}
+	}
+
+	~TimerWheel(){
+		//disarm anything still linked, so the nodes don't point at a destroyed wheel
+		for(int level = 0; level < LEVELS; level++){
+			for(int slot = 0; slot < SLOTS; slot++){
+				while(_slots[level][slot]._next != &_slots[level][slot]){
+					cancel(_slots[level][slot]._next);
+				}
+			}
+		}
+	}
+
+	unsigned int resolution() const{	return _resolution;	}
+	unsigned int size() const{	return _count;	}
+
+	//set the current time in milliseconds, usually GetTickCount(), without processing any ticks
+	void start(const unsigned long& milliseconds){
+		_last = milliseconds;
+	}
+
+	//arm a timer to expire after the given number of milliseconds, re-arming it if it is already armed
+	void arm(TimerNode* node, const unsigned int& milliseconds){
+		node->cancel();
+		unsigned int ticks = milliseconds/_resolution + ((milliseconds%_resolution)?1:0);
+		if(ticks > MAX_TICKS){
+			ticks = MAX_TICKS;
+		}
+		node->_expires = _now + ticks;
+		node->_wheel = this;
+		_count++;
+		place(node);
+	}
+
+	//disarm a timer
+	void cancel(TimerNode* node){
+		if(node->_wheel == this){
+			unlink(node);
+			node->_wheel = NULL;
+			_count--;
+		}
+	}
+
+	//process every tick up to the given time in milliseconds, usually GetTickCount()
+	void advance(const unsigned long& milliseconds){
+		unsigned long ticks = (milliseconds - _last)/_resolution;
+		_last += ticks*_resolution;
+		while(ticks-- > 0){
+			if(_count == 0){
+				_now += ticks+1;
+				break;
+			}
+			tick();
+		}
+	}
+};
+
+inline void TimerNode::cancel(){
+	if(_wheel != NULL){
+		_wheel->cancel(this);
+	}
+}
+
+#endif //_TIMER_WHEEL_H
@@ -0,0 +1,253 @@
+#include "WorkerPool.h"
+
+namespace TCP{
+//----------------------------------QueueLimit---------------------------------------//
+	void QueueLimit::handled(unsigned int count){
+		LONG queued = InterlockedExchangeAdd((LONG*)&_queued, -(LONG)count) - (LONG)count;
+		//only one thread clears the flag, so OnResume is called once per throttle
+		if(_throttled && queued <= _maxQueued/2 && InterlockedExchange((LONG*)&_throttled, 0) && OnResume != NULL){
+			OnResume(this);
+		}
+	}
+
+	bool QueueLimit::throttle(){
+		InterlockedExchange((LONG*)&_throttled, 1);
+		//the messages may have been handled before the flag could be seen
+		return !(_queued <= _maxQueued/2 && InterlockedExchange((LONG*)&_throttled, 0));
+	}
+
+//----------------------------------WorkerPool---------------------------------------//
+	WorkerPool::~WorkerPool(){
+		stop();
+	}
+
+	WorkerPool::WorkerPool()
+		:_available(NULL), _tls(TLS_OUT_OF_INDEXES), _next(0), _stopping(0){
+	}
+
+	bool WorkerPool::start(unsigned int threads){
+		stop();
+		if(threads == 0){
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			threads = info.dwNumberOfProcessors;
+		}
+
+		_tls = TlsAlloc();
+		_available = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+		if(_tls == TLS_OUT_OF_INDEXES || _available == NULL){
+			stop();
+			return false;
+		}
+		_stopping = 0;
+
+		//every queue exists before a thread can steal from it
+		for(unsigned int i = 0; i < threads; i++){
+			Worker* worker = new Worker();
+			worker->pool = this;
+			worker->index = i;
+			worker->thread = NULL;
+			INITLK(worker->queue_lock);
+			_workers.push_back(worker);
+		}
+		for(unsigned int i = 0; i < threads; i++){
+			//BeginThread, unlike CreateThread, tells the RTL it is multithreaded
+			LongWord threadId;
+			_workers[i]->thread = (HANDLE)BeginThread(NULL, 0, workerThread, _workers[i], 0, threadId);
+			if(_workers[i]->thread == NULL){
+				stop();
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void WorkerPool::stop(){
+		if(!_workers.empty()){
+			InterlockedExchange((LONG*)&_stopping, 1);
+			ReleaseSemaphore(_available, _workers.size(), NULL);
+			for(unsigned int i = 0; i < _workers.size(); i++){
+				if(_workers[i]->thread != NULL){
+					WaitForSingleObject(_workers[i]->thread, INFINITE);
+					CloseHandle(_workers[i]->thread);
+				}
+			}
+			for(unsigned int i = 0; i < _workers.size(); i++){
+				DELLK(_workers[i]->queue_lock);
+				delete _workers[i];
+			}
+			_workers.clear();
+		}
+		if(_available != NULL){
+			CloseHandle(_available);
+			_available = NULL;
+		}
+		if(_tls != TLS_OUT_OF_INDEXES){
+			TlsFree(_tls);
+			_tls = TLS_OUT_OF_INDEXES;
+		}
+		reset();
+	}
+
+	void WorkerPool::submit(WorkerTask* task){
+		if(_workers.empty()){
+			//no threads, so the caller runs it
+			task->run();
+			return;
+		}
+		unsigned int index = (unsigned int)TlsGetValue(_tls);
+		Worker* worker;
+		if(index > 0 && index <= _workers.size()){
+			worker = _workers[index-1];
+		}else{
+			worker = _workers[(unsigned int)InterlockedIncrement((LONG*)&_next) % _workers.size()];
+		}
+		{
+			CriticalLock lock(&worker->queue_lock);
+			worker->queue.push_back(task);
+		}
+		ReleaseSemaphore(_available, 1, NULL);
+	}
+
+	WorkerTask* WorkerPool::take(Worker* worker){
+		//every task is counted by the semaphore after it is queued, so one is queued somewhere
+		while(!_stopping){
+			for(unsigned int i = 0; i < _workers.size(); i++){
+				Worker* from = _workers[(worker->index + i) % _workers.size()];
+				CriticalLock lock(&from->queue_lock);
+				if(!from->queue.empty()){
+					WorkerTask* output;
+					//oldest first from its own queue, newest first when stealing
+					if(from == worker){
+						output = from->queue.front();
+						from->queue.pop_front();
+					}else{
+						output = from->queue.back();
+						from->queue.pop_back();
+					}
+					return output;
+				}
+			}
+		}
+		return NULL;
+	}
+
+	int __fastcall WorkerPool::workerThread(void* parameter){
+		Worker* worker = (Worker*)parameter;
+		WorkerPool* pool = worker->pool;
+		TlsSetValue(pool->_tls, (LPVOID)(worker->index + 1));
+		for(;;){
+			WaitForSingleObject(pool->_available, INFINITE);
+			WorkerTask* task = pool->take(worker);
+			if(task == NULL){
+				break;
+			}
+			task->run();
+		}
+		return 0;
+	}
+
+//----------------------------------WorkerStrand---------------------------------------//
+	WorkerStrand::~WorkerStrand(){
+		close();
+		CloseHandle(_idle);
+		DELLK(strand_lock);
+	}
+
+	WorkerStrand::WorkerStrand()
+		:_pool(NULL), _scheduled(false), _closed(false), _runner(0), OnMessage(NULL){
+		INITLK(strand_lock);
+		_idle = CreateEvent(NULL, TRUE, TRUE, NULL);
+	}
+
+	void WorkerStrand::open(WorkerPool* pool){
+		close();
+		CRTLK(strand_lock);
+		_pool = pool;
+		_closed = false;
+	}
+
+	void WorkerStrand::close(){
+		{
+			CRTLK(strand_lock);
+			_closed = true;
+			if(_pool != NULL && !_messages.empty()){
+				_pool->handled(_messages.size());
+			}
+			while(!_messages.empty()){
+				delete _messages.front();
+				_messages.pop_front();
+			}
+			//a closed strand is not resumed, and the message being handled is not counted
+			reset();
+			//waiting here would wait for this thread
+			if(_runner == GetCurrentThreadId()){
+				return;
+			}
+		}
+		//a queued strand runs once more and finds nothing, unless the pool was stopped and dropped it
+		if(_pool != NULL && _pool->isRunning()){
+			WaitForSingleObject(_idle, INFINITE);
+		}
+		CRTLK(strand_lock);
+		_scheduled = false;
+		SetEvent(_idle);
+	}
+
+	void WorkerStrand::add(std::vector<unsigned char>* message){
+		bool schedule = false;
+		{
+			CRTLK(strand_lock);
+			if(_closed || _pool == NULL){
+				delete message;
+				return;
+			}
+			_messages.push_back(message);
+			_pool->added();
+			added();
+			if(!_scheduled){
+				_scheduled = true;
+				ResetEvent(_idle);
+				schedule = true;
+			}
+		}
+		if(schedule){
+			_pool->submit(this);
+		}
+	}
+
+	void WorkerStrand::run(){
+		_runner = GetCurrentThreadId();
+		for(unsigned int i = 0; i < STRAND_BATCH; i++){
+			std::vector<unsigned char>* message;
+			{
+				CRTLK(strand_lock);
+				if(_messages.empty()){
+					_runner = 0;
+					_scheduled = false;
+					SetEvent(_idle);
+					return;
+				}
+				message = _messages.front();
+				_messages.pop_front();
+			}
+			if(OnMessage != NULL){
+				try{
+					OnMessage(this, *message);
+				}catch(...){}
+			}
+			delete message;
+			_pool->handled();
+			{
+				CRTLK(strand_lock);
+				if(!_closed){
+					handled();
+				}
+			}
+		}
+		//let the other strands have the worker, this one stays scheduled
+		_runner = 0;
+		_pool->submit(this);
+	}
+
+}; //end namespace TCP
@@ -0,0 +1,154 @@
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+#include "CriticalLock.h"
+#include <Classes.hpp>
+#include <vector>
+#include <deque>
+
+namespace TCP{
+	class WorkerPool;
+
+	//messages a strand handles before going to the back of the pool's queue, so one busy connection can't hold a worker
+	const unsigned int STRAND_BATCH = 64;
+
+	//work run by a WorkerPool thread
+	class WorkerTask{
+	public:
+		virtual ~WorkerTask(){}
+		virtual void run() = 0;
+	};
+
+	//Counts queued messages, so the owner can stop reading while they are not handled fast enough.
+	class QueueLimit{
+	public:
+		typedef void (__closure* Event)(QueueLimit* limit);
+
+	protected:
+		//messages queued, and the most before the owner should throttle
+		volatile LONG _queued;
+		LONG _maxQueued;
+		//set by throttle(), cleared when the queue drains to half of MaxQueued
+		volatile LONG _throttled;
+
+		//forget the queued messages, without calling OnResume
+		void reset(){
+			_queued = 0;
+			_throttled = 0;
+		}
+
+	public:
+		QueueLimit():_queued(0), _maxQueued(0), _throttled(0), OnResume(NULL), Data(NULL){}
+
+		//messages queued before the owner should throttle, 0 for no limit
+		const LONG& MaxQueued() const{	return _maxQueued;	}
+		LONG& MaxQueued(){	return _maxQueued;	}
+		LONG queued() const{	return _queued;	}
+		bool full() const{	return _maxQueued > 0 && _queued >= _maxQueued;	}
+
+		//count messages added and handled
+		void added(){	InterlockedIncrement((LONG*)&_queued);	}
+		void handled(unsigned int count = 1);
+
+		//called by the owner when it stops reading because the queue is full
+		//returns false if the queue already drained, and the owner should carry on reading
+		//otherwise OnResume is called, from the thread handling the messages, once the queue drains to half of MaxQueued
+		bool throttle();
+
+		Event OnResume;
+		//user data, usually the owner
+		void* Data;
+	};
+
+	//Thread pool where every thread has its own queue of tasks.
+	//A thread takes tasks from the front of its own queue, and steals from the back of the others when it is empty.
+	//Tasks submitted from a worker go to that worker's queue, other tasks are spread over the queues in turn.
+	//
+	//The pool also counts the messages queued in all its strands, so the owner can stop reading while the workers are behind.
+	class WorkerPool : public QueueLimit{
+	protected:
+		struct Worker{
+			WorkerPool* pool;
+			unsigned int index;
+			HANDLE thread;
+			CRITICAL_SECTION queue_lock;
+			std::deque<WorkerTask*> queue;
+		};
+
+		std::vector<Worker*> _workers;
+		//counts the tasks in all the queues, a worker waits on it before looking for a task
+		HANDLE _available;
+		//the index of the calling thread's worker + 1, 0 for other threads
+		DWORD _tls;
+		volatile LONG _next;
+		volatile LONG _stopping;
+
+		//take a task, stealing one if the worker's queue is empty
+		WorkerTask* take(Worker* worker);
+		static int __fastcall workerThread(void* parameter);
+
+	public:
+		~WorkerPool();
+		WorkerPool();
+
+		//start the threads, 0 for one per processor
+		bool start(unsigned int threads = 0);
+		//wait for the running tasks to finish and end the threads, tasks still queued are not run
+		void stop();
+		bool isRunning() const{	return !_workers.empty();	}
+		//true if called from one of the pool's threads
+		bool isWorker() const{	return _tls != TLS_OUT_OF_INDEXES && TlsGetValue(_tls) != NULL;	}
+		unsigned int threads() const{	return _workers.size();	}
+
+		//queue a task, it is run once by one of the threads
+		void submit(WorkerTask* task);
+	};
+
+	//Messages of one connection.
+	//The strand is queued on the pool while it has messages, and only one thread runs it at a time,
+	//so messages are handled in the order they were added, and different strands are handled in parallel.
+	//The strand counts its own messages too, so one connection the workers can't keep up with is throttled
+	//before it fills the pool and stops the others.
+	class WorkerStrand : public WorkerTask, public QueueLimit{
+	public:
+		typedef void (__closure* MessageEvent)(WorkerStrand* strand, std::vector<unsigned char>& message);
+
+	protected:
+		WorkerPool* _pool;
+		CRITICAL_SECTION strand_lock;
+		std::deque<std::vector<unsigned char>*> _messages;
+		//true while the strand is queued on the pool or running
+		bool _scheduled;
+		bool _closed;
+		//set while the strand is not scheduled
+		HANDLE _idle;
+		//the thread running the strand, 0 while it is not running
+		volatile DWORD _runner;
+
+	public:
+		virtual ~WorkerStrand();
+		WorkerStrand();
+
+		//start taking messages for the pool
+		void open(WorkerPool* pool);
+		//drop the messages not yet handled and wait for the one being handled
+		//called from OnMessage it does not wait, the strand stops once OnMessage returns
+		void close();
+		bool isOpen() const{	return _pool != NULL && !_closed;	}
+
+		//queue a message, the strand takes ownership of it
+		void add(std::vector<unsigned char>* message);
+
+		//handle queued messages, called by the pool
+		virtual void run();
+
+		//called for each message on a worker thread
+		MessageEvent OnMessage;
+
+	private:
+		WorkerStrand(const WorkerStrand& other);
+		WorkerStrand& operator=(const WorkerStrand& other);
+	};
+}; //end namespace TCP
+
+#endif //_WORKER_POOL_H
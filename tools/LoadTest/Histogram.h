@@ -0,0 +1,98 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <vector>
+#include <algorithm>
+
+//Histogram of latencies with a fixed relative precision, in the style of HdrHistogram.
+//Values below SUB_BUCKETS are counted exactly, larger values are bucketed by their highest set bit
+//with SUB_BUCKETS/2 linear sub-buckets per power of two, so a percentile is within 1/128 of the real value.
+//Recording is O(1) and the whole histogram is a few thousand counters.
+class LatencyHistogram{
+public:
+	enum{
+		SUB_BUCKET_BITS = 8,
+		SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+		HALF_BUCKETS = SUB_BUCKETS/2,
+		COUNTS = SUB_BUCKETS + (32-SUB_BUCKET_BITS)*HALF_BUCKETS
+	};
+
+protected:
+	std::vector<unsigned __int64> _counts;
+	unsigned __int64 _total;
+	unsigned __int64 _sum;
+	unsigned int _min;
+	unsigned int _max;
+
+	static unsigned int indexOf(unsigned int value){
+		if(value < SUB_BUCKETS){
+			return value;
+		}
+		unsigned int shift = 0;
+		while((value >> shift) >= SUB_BUCKETS){
+			shift++;
+		}
+		return SUB_BUCKETS + (shift-1)*HALF_BUCKETS + ((value >> shift) - HALF_BUCKETS);
+	}
+
+	//highest value counted at the index
+	static unsigned int valueAt(unsigned int index){
+		if(index < SUB_BUCKETS){
+			return index;
+		}
+		unsigned int shift = (index - SUB_BUCKETS)/HALF_BUCKETS + 1;
+		unsigned int sub = (index - SUB_BUCKETS)%HALF_BUCKETS + HALF_BUCKETS;
+		return ((sub+1) << shift) - 1;
+	}
+
+public:
+	LatencyHistogram():_counts(COUNTS, 0),_total(0),_sum(0),_min(0xFFFFFFFF),_max(0){}
+
+	void record(const unsigned int& value){
+		_counts[indexOf(value)]++;
+		_total++;
+		_sum += value;
+		if(value < _min)	_min = value;
+		if(value > _max)	_max = value;
+	}
+
+	//add the counts of another histogram
+	void add(const LatencyHistogram& other){
+		for(unsigned int i = 0; i < COUNTS; i++){
+			_counts[i] += other._counts[i];
+		}
+		_total += other._total;
+		_sum += other._sum;
+		if(other._min < _min)	_min = other._min;
+		if(other._max > _max)	_max = other._max;
+	}
+
+	void clear(){
+		std::fill(_counts.begin(), _counts.end(), 0);
+		_total = _sum = 0;
+		_min = 0xFFFFFFFF;
+		_max = 0;
+	}
+
+	unsigned __int64 count() const{	return _total;	}
+	unsigned int minimum() const{	return _total?_min:0;	}
+	unsigned int maximum() const{	return _max;	}
+	double mean() const{	return _total?(double)(__int64)_sum/(__int64)_total:0;	}
+
+	//value at or below which the given percent of the values fall, 50 for the median
+	unsigned int percentile(const double& percent) const{
+		unsigned __int64 target = (unsigned __int64)(percent/100*(__int64)_total + 0.5);
+		if(target == 0)	target = 1;
+		unsigned __int64 seen = 0;
+		for(unsigned int i = 0; i < COUNTS; i++){
+			seen += _counts[i];
+			if(seen >= target){
+				unsigned int output = valueAt(i);
+				return output < _max ? output : _max;
+			}
+		}
+		return _max;
+	}
+};
+
+#endif //_HISTOGRAM_H
@@ -0,0 +1,306 @@
+//Load generator and latency harness for TCP::client and TCP::server.
+//Runs an echo server and many clients in one process, connected over loopback,
+//and reports throughput and round trip latency percentiles.
+//
+//Build as a C++Builder console application using the VCL, with TCP.cpp, Capture.cpp, SharedMemory.cpp and WorkerPool.cpp added to the project.
+//
+//	LoadTest [-port 5555] [-connections 100] [-duration 10] [-warmup 2]
+//	         [-size 64 | -size 64-4096] [-rate 1000 | -window 1] [-shm 1] [-workers 4]
+//
+//-size is the message size in bytes, or a range messages are uniformly sized within.
+//-rate runs open loop: every connection sends that many messages per second whatever the replies do,
+//and latency is measured from when each message was due to be sent, so a stalled server is not hidden.
+//-window runs closed loop: every connection keeps that many messages outstanding.
+//-shm 1 switches the connections to the shared memory transport, to compare it with loopback TCP.
+//-workers echoes from the server's worker threads instead of the VCL thread.
+
+#include <vcl.h>
+#pragma hdrstop
+
+#include "..\..\TCP.h"
+#include "Histogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//the send time at the start of every message
+const unsigned int STAMP_SIZE = sizeof(unsigned __int64);
+//most messages one connection sends per pass of the loop, so the message pump is never starved
+const int MAX_BURST = 100;
+
+struct Options{
+	int port;
+	int connections;
+	double duration;
+	double warmup;
+	unsigned int minSize;
+	unsigned int maxSize;
+	//messages per second per connection, open loop if not 0
+	double rate;
+	//outstanding messages per connection, closed loop
+	int window;
+	bool sharedMemory;
+	//server worker threads, 0 to echo on the VCL thread
+	unsigned int workers;
+
+	Options():port(5555),connections(100),duration(10),warmup(2),minSize(64),maxSize(64),rate(0),window(1),sharedMemory(false),workers(0){}
+};
+
+struct Stats{
+	unsigned __int64 sent;
+	unsigned __int64 received;
+	unsigned __int64 bytes;
+	LatencyHistogram latency;
+	bool recording;
+
+	Stats():sent(0),received(0),bytes(0),recording(false){}
+	void reset(){
+		sent = received = bytes = 0;
+		latency.clear();
+	}
+};
+
+//----------------------------------time---------------------------------------//
+static LARGE_INTEGER frequency;
+
+static unsigned __int64 now(){
+	LARGE_INTEGER output;
+	QueryPerformanceCounter(&output);
+	return output.QuadPart;
+}
+
+static unsigned __int64 ticks(const double& seconds){
+	return (unsigned __int64)(seconds*frequency.QuadPart);
+}
+
+static unsigned int microseconds(const unsigned __int64& elapsed){
+	return (unsigned int)((__int64)elapsed*1000000/frequency.QuadPart);
+}
+
+//----------------------------------EchoServer---------------------------------------//
+//sends every message straight back to the client it came from
+class EchoServer{
+protected:
+	std::vector<unsigned char> message;
+
+	void onClientRead(TCP::serverClientSocket* client){
+		message.clear();
+		while(client->getMessage(message)){
+			client->send(message.begin(), message.size());
+			message.clear();
+		}
+	}
+
+	//called on a worker thread
+	void onClientMessage(TCP::serverClientSocket* client, std::vector<unsigned char>& message){
+		client->send(message.begin(), message.size());
+	}
+
+public:
+	TCP::server server;
+
+	EchoServer(const Options& options):server(options.port){
+		server.OnClientRead = onClientRead;
+		server.OnClientMessage = onClientMessage;
+		server.SharedMemory() = options.sharedMemory;
+		server.Workers() = options.workers;
+	}
+};
+
+//----------------------------------LoadConnection---------------------------------------//
+class LoadConnection{
+protected:
+	const Options& options;
+	Stats& stats;
+
+	std::vector<unsigned char> out, in;
+	//open loop: when the next message is due, and the time between messages
+	unsigned __int64 nextSend;
+	unsigned __int64 interval;
+	int outstanding;
+
+	void onConnect(TCP::client* sender){
+		//spread the connections over the first interval, so they don't all send at once
+		//RAND_MAX is only 0x7FFF, so scale rand() rather than taking it modulo the interval
+		nextSend = now() + (unsigned __int64)((double)rand()/RAND_MAX*(__int64)interval);
+	}
+
+	void onRead(TCP::client* sender){
+		in.clear();
+		while(client.getMessage(in)){
+			if(in.size() >= STAMP_SIZE && stats.recording){
+				stats.latency.record(microseconds(now() - *((unsigned __int64*)in.begin())));
+				stats.received++;
+				stats.bytes += in.size();
+			}
+			outstanding--;
+			in.clear();
+		}
+	}
+
+	//stamp is the time the message is measured from
+	void send(const unsigned __int64& stamp){
+		unsigned int size = options.minSize;
+		if(options.maxSize > options.minSize){
+			size += (unsigned int)rand() % (options.maxSize - options.minSize + 1);
+		}
+		out.resize(size);
+		*((unsigned __int64*)out.begin()) = stamp;
+		//send returns false when the socket is full, the message is still queued
+		client.send(out.begin(), size);
+		outstanding++;
+		if(stats.recording){
+			stats.sent++;
+		}
+	}
+
+public:
+	TCP::client client;
+
+	LoadConnection(const Options& opts, Stats& st)
+		:options(opts), stats(st), nextSend(0), interval(0), outstanding(0){
+		if(options.rate > 0){
+			interval = ticks(1/options.rate);
+		}
+		client.OnConnect = onConnect;
+		client.OnRead = onRead;
+		client.SharedMemory() = options.sharedMemory;
+	}
+
+	bool connected() const{	return client.connectionStatus() == TCP::CONNECTION_CONNECTED;	}
+
+	//send whatever is due
+	void pump(const unsigned __int64& time){
+		int burst = 0;
+		if(options.rate > 0){
+			//a message is due every interval, however late the previous ones were
+			while(nextSend <= time && burst++ < MAX_BURST){
+				send(nextSend);
+				nextSend += interval;
+			}
+		}else{
+			while(outstanding < options.window && burst++ < MAX_BURST){
+				send(now());
+			}
+		}
+	}
+};
+
+//----------------------------------main---------------------------------------//
+static bool parseSize(const char* text, Options& options){
+	const char* dash = strchr(text, '-');
+	options.minSize = atoi(text);
+	options.maxSize = dash ? atoi(dash+1) : options.minSize;
+	return options.minSize >= STAMP_SIZE && options.maxSize >= options.minSize;
+}
+
+static bool parseOptions(int argc, char* argv[], Options& options){
+	for(int i = 1; i < argc; i++){
+		if(i+1 >= argc){
+			return false;
+		}
+		const char* name = argv[i];
+		const char* value = argv[++i];
+		if(strcmp(name, "-port") == 0){
+			options.port = atoi(value);
+		}else if(strcmp(name, "-connections") == 0){
+			options.connections = atoi(value);
+		}else if(strcmp(name, "-duration") == 0){
+			options.duration = atof(value);
+		}else if(strcmp(name, "-warmup") == 0){
+			options.warmup = atof(value);
+		}else if(strcmp(name, "-size") == 0){
+			if(!parseSize(value, options)){
+				return false;
+			}
+		}else if(strcmp(name, "-rate") == 0){
+			options.rate = atof(value);
+		}else if(strcmp(name, "-window") == 0){
+			options.window = atoi(value);
+		}else if(strcmp(name, "-shm") == 0){
+			options.sharedMemory = atoi(value) != 0;
+		}else if(strcmp(name, "-workers") == 0){
+			options.workers = atoi(value);
+		}else{
+			return false;
+		}
+	}
+	return options.connections > 0 && options.duration > 0 && options.window > 0;
+}
+
+static void report(const Options& options, const Stats& stats){
+	double seconds = options.duration;
+	printf("connections  %d\n", options.connections);
+	if(options.rate > 0){
+		printf("mode         open loop, %.0f msg/s per connection\n", options.rate);
+	}else{
+		printf("mode         closed loop, %d outstanding per connection\n", options.window);
+	}
+	printf("transport    %s\n", options.sharedMemory ? "shared memory" : "tcp");
+	printf("workers      %u\n", options.workers);
+	printf("size         %u-%u bytes\n", options.minSize, options.maxSize);
+	printf("sent         %.0f msg\n", (double)(__int64)stats.sent);
+	printf("received     %.0f msg\n", (double)(__int64)stats.received);
+	printf("throughput   %.0f msg/s, %.2f MB/s\n",
+		(double)(__int64)stats.received/seconds, (double)(__int64)stats.bytes/seconds/(1024*1024));
+	printf("latency (us) min %u  mean %.1f  p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+		stats.latency.minimum(), stats.latency.mean(),
+		stats.latency.percentile(50), stats.latency.percentile(90),
+		stats.latency.percentile(99), stats.latency.percentile(99.9),
+		stats.latency.maximum());
+}
+
+int main(int argc, char* argv[]){
+	Options options;
+	if(!parseOptions(argc, argv, options)){
+		printf("LoadTest [-port 5555] [-connections 100] [-duration 10] [-warmup 2]\n");
+		printf("         [-size 64 | -size 64-4096] [-rate 1000 | -window 1] [-shm 1] [-workers 4]\n");
+		return 1;
+	}
+	QueryPerformanceFrequency(&frequency);
+
+	EchoServer echo(options);
+	if(!echo.server.listen()){
+		printf("could not listen on port %d\n", options.port);
+		return 1;
+	}
+
+	Stats stats;
+	std::vector<LoadConnection*> connections;
+	for(int i = 0; i < options.connections; i++){
+		connections.push_back(new LoadConnection(options, stats));
+		connections.back()->client.connect("127.0.0.1", options.port);
+	}
+
+	unsigned __int64 start = now();
+	unsigned __int64 measureStart = start + ticks(options.warmup);
+	unsigned __int64 measureEnd = measureStart + ticks(options.duration);
+
+	unsigned __int64 time = start;
+	while(time < measureEnd){
+		Application->ProcessMessages();
+		time = now();
+		if(!stats.recording && time >= measureStart){
+			stats.reset();
+			stats.recording = true;
+		}
+		for(unsigned int i = 0; i < connections.size(); i++){
+			if(connections[i]->connected()){
+				connections[i]->pump(time);
+			}
+		}
+	}
+	stats.recording = false;
+
+	report(options, stats);
+
+	for(unsigned int i = 0; i < connections.size(); i++){
+		connections[i]->client.disconnect();
+	}
+	Application->ProcessMessages();
+	for(unsigned int i = 0; i < connections.size(); i++){
+		delete connections[i];
+	}
+	echo.server.stop();
+	return 0;
+}